@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tdgif_lib.h"
+#include "tegif_lib.h"
+
+/* Stand-in for an SPI/QSPI flash or SD card: every read costs SetupNs
+ * (command, address, dummy cycles) plus ByteNs per byte transferred. */
+typedef struct FlashModel {
+	const uint8_t *Image;
+	uint16_t Len;
+	unsigned SetupNs, ByteNs;
+	unsigned long Reads, Bytes;
+} FlashModel;
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void Spin(uint64_t ns) {
+	if (!ns) return;
+	uint64_t end = NowNs() + ns;
+	while (NowNs() < end);
+}
+
+static uint16_t FlashRead(void *Ctx, uint16_t Offset, uint8_t *Buf, uint16_t Len) {
+	FlashModel *F = Ctx;
+	if (Offset >= F->Len) return 0;
+	if (Len > F->Len - Offset) Len = F->Len - Offset;
+	Spin(F->SetupNs + (uint64_t)F->ByteNs * Len);
+	memcpy(Buf, F->Image + Offset, Len);
+	F->Reads++;
+	F->Bytes += Len;
+	return Len;
+}
+
+static void PrintError(int error) {
+	fprintf(stderr,"[T]GIF Error: %d\n", error);
+}
+
+static void Usage(const char *name) {
+	fprintf(stderr, "%s [-n runs] [-b refill bytes] [-s read setup ns] [-p ns per byte]\n"
+		"\t[-i restart points [-t max threads]] [-P preset.bin] [-z scale] <tgif.bin>\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	int runs = 20, refill = 0, threads = sysconf(_SC_NPROCESSORS_ONLN), scale = 0, opt;
+	unsigned setup_ns = 0, byte_ns = 0;
+	const char *index_name = NULL;
+	static uint8_t preset[TGIF_PRESET_HEADER_SIZE + 3 * TGIF_PRESET_MAX_ENTRIES];
+	uint16_t preset_len = 0;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "n:b:s:p:i:t:P:z:")) != -1) {
+		switch (opt) {
+		case 'i': index_name = optarg; break;
+		case 'P':
+			if (!(f = fopen(optarg, "rb"))) {
+				fprintf(stderr, "open '%s' failed\n", optarg);
+				return 2;
+			}
+			preset_len = fread(preset, 1, sizeof(preset), f);
+			fclose(f);
+			break;
+		case 't': threads = atoi(optarg); break;
+		case 'z': scale = atoi(optarg); break;
+		case 'n': runs = atoi(optarg); break;
+		case 'b': refill = atoi(optarg); break;
+		case 's': setup_ns = atoi(optarg); break;
+		case 'p': byte_ns = atoi(optarg); break;
+		default: Usage(argv[0]);
+		}
+	}
+	if ((optind != argc - 1) || (runs < 1)) Usage(argv[0]);
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd<0) {
+		fprintf(stderr, "open '%s' failed\n", argv[optind]);
+		return 2;
+	}
+	int len = lseek(fd, 0, SEEK_END);
+	if (len<0) {
+		fprintf(stderr, "cannot determine file size");
+		return 3;
+	}
+	const void *data = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "failed to mmap file");
+		return 4;
+	}
+
+	TGifInfo Info;
+	if (TDGifGetInfo(data, &Info, 1023, 1023, len) == TGIF_ERROR ||
+	    TDGifSetPreset(&Info, preset, preset_len) == TGIF_ERROR) {
+		PrintError(Info.Error);
+		return 5;
+	}
+	printf("%dx%d image with %d colors, %d bytes of SRAM, %d bytes of data\n",
+		Info.Width, Info.Height, Info.ColorCount, Info.SRAMLimit, Info.MaxSz);
+
+	uint8_t *fb = malloc(Info.Width * Info.Height * 2);
+
+	uint64_t t = NowNs();
+	for (int n = 0; n < runs; n++) {
+		if (TDGifDecompressToBuffer(&Info, fb, Info.Width, TDGIF_FMT_INDEX8) == TGIF_ERROR) {
+			PrintError(Info.Error);
+			return 6;
+		}
+	}
+	t = NowNs() - t;
+	printf("memory mapped:  %8.1f us/decode\n", t / 1000.0 / runs);
+
+	/* Same, with the dictionary in a workspace instead of malloc'd per decode */
+	static uint16_t Workspace[(TDGIF_MAX_WORKSPACE + TGIF_PRESET_MAX_ENTRIES + 2) / 2];
+	TDGifSetWorkspace(&Info, (uint8_t*)Workspace, sizeof(Workspace));
+	t = NowNs();
+	for (int n = 0; n < runs; n++) {
+		if (TDGifDecompressToBuffer(&Info, fb, Info.Width, TDGIF_FMT_INDEX8) == TGIF_ERROR) {
+			PrintError(Info.Error);
+			return 6;
+		}
+	}
+	t = NowNs() - t;
+	printf("  + workspace:  %8.1f us/decode\n", t / 1000.0 / runs);
+	TDGifSetWorkspace(&Info, NULL, 0);
+
+	/* And encode it back into memory, with the same SRAM limit (and so as
+	 * many clears) */
+	TColorMapObject ColorMap = { Info.ColorCount, { 0 } };
+	memcpy(ColorMap.Colors, Info.Colors, Info.ColorCount * sizeof(TGifColorType));
+	t = NowNs();
+	for (int n = 0; n < runs; n++) {
+		int error;
+		TGifByteType *Data;
+		size_t DataLen;
+		TGifFileType *GifFile = TEGifOpenMemory(&Data, &DataLen, &error);
+		if (!GifFile) {
+			PrintError(error);
+			return 8;
+		}
+		if (TEGifSetPreset(GifFile, Info.Preset, preset_len) == TGIF_ERROR ||
+		    TEGifPutScreenDesc(GifFile, Info.Width, Info.Height, &ColorMap, Info.SRAMLimit) == TGIF_ERROR ||
+		    TEGifPutLine(GifFile, fb, Info.Width * Info.Height) == TGIF_ERROR) {
+			PrintError(GifFile->Error);
+			return 8;
+		}
+		if (TEGifCloseFile(GifFile, &error) == TGIF_ERROR) {
+			PrintError(error);
+			return 8;
+		}
+		free(Data);
+	}
+	t = NowNs() - t;
+	printf("encode:         %8.1f us/encode\n", t / 1000.0 / runs);
+
+	/* The same, reusing one encoder for all of them */
+	{
+		int error;
+		TGifByteType *Data = NULL;
+		size_t DataLen;
+		TGifFileType *GifFile = TEGifOpenMemory(&Data, &DataLen, &error);
+		if (!GifFile) {
+			PrintError(error);
+			return 8;
+		}
+		t = NowNs();
+		for (int n = 0; n < runs; n++) {
+			if (TEGifSetPreset(GifFile, Info.Preset, preset_len) == TGIF_ERROR ||
+			    TEGifPutScreenDesc(GifFile, Info.Width, Info.Height, &ColorMap, Info.SRAMLimit) == TGIF_ERROR ||
+			    TEGifPutLine(GifFile, fb, Info.Width * Info.Height) == TGIF_ERROR ||
+			    TEGifReset(GifFile) == TGIF_ERROR) {
+				PrintError(GifFile->Error);
+				return 8;
+			}
+			free(Data);
+		}
+		t = NowNs() - t;
+		TEGifCloseFile(GifFile, &error);
+		free(Data);
+		printf("  + reused:     %8.1f us/encode\n", t / 1000.0 / runs);
+	}
+
+	static TGifRestartPoint Points[1024];
+	int NumPoints = 0;
+	if (index_name && (f = fopen(index_name, "rb"))) {
+		NumPoints = fread(Points, sizeof(TGifRestartPoint), 1024, f);
+		fclose(f);
+	}
+
+	if (scale) {
+		/* Previews: full size for comparison, then scaled down, nearest
+		 * (and skipping strips, with restart points) and box filtered */
+		static const char *names[] = { "full RGB565:", "nearest:", "  + restart:", "box:" };
+		for (int mode = 0; mode < 4; mode++) {
+			if (mode == 2 && !NumPoints)
+				continue;
+			uint8_t s = mode ? scale : 1;
+			t = NowNs();
+			for (int n = 0; n < runs; n++) {
+				if (TDGifDecompressScaled(&Info, Points, mode == 2 ? NumPoints : 0, s,
+						mode == 3 ? TDGIF_SCALE_BOX : TDGIF_SCALE_NEAREST, fb,
+						TDGIF_SCALED(Info.Width, s) * 2, TDGIF_FMT_RGB565) == TGIF_ERROR) {
+					PrintError(Info.Error);
+					return 6;
+				}
+			}
+			t = NowNs() - t;
+			printf("%-15s %8.1f us/decode\n", names[mode], t / 1000.0 / runs);
+		}
+	}
+
+	if (index_name) {
+		/* The strips between restart points, on more and more threads */
+		printf("%d strips\nthreads  us/decode  speedup\n", NumPoints + 1);
+		double single = 0;
+		for (int th = 1; th <= threads; th++) {
+			t = NowNs();
+			for (int n = 0; n < runs; n++) {
+				if (TDGifDecompressStrips(&Info, Points, NumPoints, fb, Info.Width,
+						TDGIF_FMT_INDEX8, th) == TGIF_ERROR) {
+					PrintError(Info.Error);
+					return 6;
+				}
+			}
+			t = NowNs() - t;
+			if (th == 1) single = t;
+			printf("%7d %10.1f %8.2f\n", th, t / 1000.0 / runs, single / t);
+		}
+	}
+
+	/* Then through the flash model, either with the given refill buffer
+	 * size or a sweep of them. */
+	static const int sweep[] = { 8, 16, 32, 64, 128, 256, 512, 0 };
+	int one[] = { refill, 0 };
+	const int *sizes = refill ? one : sweep;
+
+	printf("flash model: %u ns per read + %u ns per byte\n", setup_ns, byte_ns);
+	printf("refill   reads/decode  bytes/decode  us/decode\n");
+	for (; *sizes; sizes++) {
+		FlashModel Flash = { data, len, setup_ns, byte_ns, 0, 0 };
+		uint8_t *Buf = malloc(*sizes);
+		TGifSource Source = { FlashRead, &Flash, Buf, *sizes };
+		TGifInfo SInfo;
+
+		t = NowNs();
+		for (int n = 0; n < runs; n++) {
+			if ((TDGifGetInfoSource(&Source, &SInfo, 1023, 1023, len) == TGIF_ERROR) ||
+			    (TDGifSetPreset(&SInfo, preset, preset_len) == TGIF_ERROR) ||
+			    (TDGifDecompressToBuffer(&SInfo, fb, SInfo.Width, TDGIF_FMT_INDEX8) == TGIF_ERROR)) {
+				PrintError(SInfo.Error);
+				return 7;
+			}
+		}
+		t = NowNs() - t;
+		printf("%6d %14.1f %13.1f %10.1f\n", *sizes, (double)Flash.Reads / runs,
+			(double)Flash.Bytes / runs, t / 1000.0 / runs);
+		free(Buf);
+	}
+
+	free(fb);
+	return 0;
+}
@@ -2,22 +2,92 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <gif_lib.h>
 #include "tegif_lib.h"
+#include "quantize.h"
+#include "preset.h"
 
-TColorMapObject TGifColors;
+typedef struct ConvertOptions {
+	uint16_t SRAMLimit, RestartRows, Strips;
+	int ClearPolicy;      /* TEGIF_CLEAR_* */
+	int Parse;            /* TEGIF_PARSE_* */
+	int MaxError;         /* Lossy, 0 for lossless */
+	bool Auto;            /* Try every SRAM limit up to SRAMLimit */
+	long Budget;          /* and take the smallest that fits, if set */
+	int Threads;          /* Encoding the candidates on this many threads */
+	bool Curve;           /* and print them all */
+	int Colors;           /* Truecolor input: at most this many colors, */
+	bool Dither;          /* ordered dithered */
+	int RawWidth, RawHeight; /* Raw RGB input of this size */
+	bool Anim;            /* All frames, into a tiny animation */
+	const TGifByteType *Preset; /* Preset dictionary, NULL for none, */
+	size_t PresetLen;     /* of this many bytes */
+	bool SortColors;      /* Palettes in RGB565 order, for a preset */
+} ConvertOptions;
 
-static uint8_t MapColor(uint8_t r, uint8_t g, uint8_t b) {
+/* What happened to one image, for the report */
+typedef struct ConvertResult {
+	int Width, Height, Colors;
+	int MaxCode, Restarts;
+	int Frames;           /* Of an animation, 0 for an image */
+	int Transparent;      /* Color index, -1 for none */
+	uint16_t SRAMLimit;
+	long InBytes, OutBytes;
+	double Ms;
+	const char *Failed;   /* What failed, NULL if nothing did */
+	int Error;
+} ConvertResult;
+
+/* An input image, remapped to its RGB565 palette */
+typedef struct ConvertImage {
+	int Width, Height;
+	TColorMapObject Colors;
+	int Transparent;      /* Color index, -1 for none */
+	uint8_t *Pixels;
+} ConvertImage;
+
+/* An animated GIF, every frame drawn onto the screen the way a viewer
+ * would, in the palette of all of them */
+typedef struct ConvertAnimation {
+	int Width, Height, FrameCount;
+	TColorMapObject Colors;
+	uint8_t *Screens;     /* FrameCount of them, one after the other */
+	uint16_t *Delays;     /* In 1/100 s */
+} ConvertAnimation;
+
+/* One encode of it */
+typedef struct Encoding {
+	uint16_t SRAMLimit;
+	TGifByteType *Data;
+	size_t Len;
+	int MaxCode;
+	TGifRestartPoint *Points;
+	int NumPoints;
+	int Error;            /* 0 if ok */
+} Encoding;
+
+/* Biggest image the decoder can take */
+#define MAX_TGIF_SIZE 65535
+
+/* The index of r, g, b in TGifColors, other than Skip, added if it is new.
+ * -1 if it is new and there are 256 already. */
+static int MapColor(TColorMapObject *TGifColors, int Skip, uint8_t r, uint8_t g, uint8_t b) {
 	uint16_t c = (((r<<8)&0xF800) | ((g<<3)&0x07E0) | (b>>3));
-	for(int i=0;i < TGifColors.ColorCount;i++) {
-		if (c == TGifColors.Colors[i]) return i;
+	for(int i=0;i < TGifColors->ColorCount;i++) {
+		if (c == TGifColors->Colors[i] && i != Skip) return i;
 	}
-	int idx = TGifColors.ColorCount;
-	TGifColors.Colors[TGifColors.ColorCount++] = c;
+	if (TGifColors->ColorCount == 256) return -1;
+	int idx = TGifColors->ColorCount;
+	TGifColors->Colors[TGifColors->ColorCount++] = c;
 	return idx;
 }
 
@@ -25,32 +95,81 @@ static void PrintGifError(int error) {
 	fprintf(stderr,"[T]GIF Error: %d\n", error);
 }
 
-int main(int argc, char** argv) {
-	GifFileType *GifFile;
-	uint16_t sram_limit = 3072;
-	if ((argc < 3)||(argc > 4)) {
-		fprintf(stderr, "%s <in.gif> <out.bin> [SRAM]", argv[0]);
-		return 1;
-	}
+static void Usage(const char *name) {
+	fprintf(stderr, "%s [-a | -m max bytes] [-c] [-f] [-l max error] [-q colors] [-d] [-g WxH] [-P file]\n"
+		"\t[-r restart rows | -s strips | -A] <in.gif | in.ppm | in.pam | in.rgb> <out.bin> [SRAM]\n"
+		"%s -b [-j threads] [-a | -m max bytes] [-c] [-f] [-l max error] [-q colors] [-d] [-g WxH] [-P file]\n"
+		"\t[-r restart rows | -s strips | -A] <dir | list> <out dir> [SRAM]\n"
+		"%s -p [-c] [-f] [-l max error] [-q colors] [-d] [-g WxH] [-P file] <dir | list> <out.bin> [SRAM]\n"
+		"%s -T entries [-c] [-f] [-l max error] [-q colors] [-d] [-g WxH] <dir | list> <preset.bin> [SRAM]\n"
+		"\t-a: try every SRAM limit up to SRAM (default 4096), keep the smallest output\n"
+		"\t-m: or the smallest SRAM limit that gives at most max bytes\n"
+		"\t-c: adaptive clears, keep a full dictionary while it compresses well\n"
+		"\t-f: flexible parse, slower to encode but smaller\n"
+		"\t-l: lossy, pixels may be off by up to max error (8 bit RGB distance)\n"
+		"\t-q: quantize truecolor (PPM, PAM or raw RGB) input to at most this many\n"
+		"\t    colors (default 256); with -m, the most of those that fit\n"
+		"\t-d: ordered dither when quantizing\n"
+		"\t-g: inputs that are not GIF, PPM or PAM are raw RGB of this size\n"
+		"\t-A: all frames of an animated GIF, into a tiny animation\n"
+		"\t-p: all of the images into one tiny archive, sharing palettes\n"
+		"\t-T: train a preset dictionary of up to entries entries on the images\n"
+		"\t-P: start with the preset dictionary from file, where that is smaller\n",
+		name, name, name, name);
+	exit(1);
+}
+
+static double NowMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
+static int WriteFile(const char *name, const void *Data, size_t Size, size_t Count) {
+	FILE *f = fopen(name, "wb");
+	if (!f) return -1;
+	size_t r = fwrite(Data, Size, Count, f);
+	if (fclose(f) || (r != Count)) return -1;
+	return 0;
+}
+
+/* The restart points go next to the output, in <out.bin>.idx */
+static int WriteRestartPoints(const char *out_name, const TGifRestartPoint *Points, int Count) {
+	char name[strlen(out_name) + 5];
+	sprintf(name, "%s.idx", out_name);
+	return WriteFile(name, Points, sizeof(TGifRestartPoint), Count);
+}
+
+/* Read all of the GIF in_name. Returns NULL and fills in R->Failed if that
+ * fails. */
+static GifFileType *ReadGif(const char *in_name, ConvertResult *R) {
+	GifFileType *GifFile;
 	int Error;
-	if ((GifFile = DGifOpenFileName(argv[1], &Error)) == NULL) {
-		PrintGifError(Error);
-		exit(EXIT_FAILURE);
-	}
 
+	if ((GifFile = DGifOpenFileName(in_name, &Error)) == NULL) {
+		R->Failed = "open";
+		R->Error = Error;
+		return NULL;
+	}
 	if (DGifSlurp(GifFile) == GIF_ERROR) {
-		PrintGifError(GifFile->Error);
-		exit(EXIT_FAILURE);
+		R->Failed = "read";
+		R->Error = GifFile->Error;
+		DGifCloseFile(GifFile, &Error);
+		return NULL;
 	}
+	return GifFile;
+}
 
-	TGifFileType *TGif = TEGifOpenFileName(argv[2], &Error);
+/* Read in_name into Img. Returns 0 if ok, otherwise fills in R->Failed. */
+static int LoadImage(const char *in_name, ConvertImage *Img, ConvertResult *R) {
+	GifFileType *GifFile;
+	int Error;
 
-	if (!TGif) {
-		/* This is crude hack, but the codes should actually match :P */
-		PrintGifError(Error);
-		exit(EXIT_FAILURE);
-	}
+	if ((GifFile = ReadGif(in_name, R)) == NULL)
+		return -1;
+
+	GraphicsControlBlock GCB = { DISPOSAL_UNSPECIFIED, false, 0, NO_TRANSPARENT_COLOR };
+	DGifSavedExtensionToGCB(GifFile, 0, &GCB);
 
 	const ColorMapObject *InputColors = 0;
 	if (GifFile->SavedImages->ImageDesc.ColorMap) InputColors = GifFile->SavedImages->ImageDesc.ColorMap;
@@ -61,52 +180,1271 @@ int main(int argc, char** argv) {
 	const uint8_t * InPixels = GifFile->SavedImages->RasterBits;
 	const int PixelCount = Width*Height;
 	uint8_t *OutPixels = malloc(PixelCount);
+	if (!OutPixels) {
+		R->Failed = "alloc";
+		R->Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
+		DGifCloseFile(GifFile, &Error);
+		return -1;
+	}
 
 	/* We perform a palette remapping to:
 	 * 1. Only include the colors that are used in the image
 	 * 2. Make sure the palette is not sparse
-	 * 3. Combine any RGB888 colors that are the same in RGB565 */
+	 * 3. Combine any RGB888 colors that are the same in RGB565
+	 * 4. Keep the transparent color apart, even from the same RGB565
+	 * The order is whatever comes first. For an image on its own, any
+	 * other would encode to the same size: LZW only cares which pixels
+	 * are the same, not what their indices are, and the code width only
+	 * depends on how many there are. Not so in an archive (-p), where the
+	 * color count is the highest shared palette index used, or with a
+	 * preset dictionary (-T, -P), whose strings are of indices: there
+	 * SortColors puts them in order of use, alike for alike images. */
 
 	int16_t PaletteMap[256];
 	memset(PaletteMap, 0xFF, 256 * sizeof(int16_t));
 
-	TGifColors.ColorCount = 0;
+	Img->Colors.ColorCount = 0;
+	Img->Transparent = -1;
 
 	for (int i=0;i < PixelCount;i++) {
 		uint8_t p = InPixels[i];
 		if (PaletteMap[p] < 0) {
-			PaletteMap[p] = MapColor(InputColors->Colors[p].Red, InputColors->Colors[p].Green, InputColors->Colors[p].Blue);
+			const GifColorType *c = &InputColors->Colors[p];
+			if (p != GCB.TransparentColor) {
+				PaletteMap[p] = MapColor(&Img->Colors, Img->Transparent, c->Red, c->Green, c->Blue);
+			} else if (Img->Colors.ColorCount < 256) {
+				PaletteMap[p] = Img->Transparent = Img->Colors.ColorCount++;
+				Img->Colors.Colors[Img->Transparent] =
+					((c->Red<<8)&0xF800) | ((c->Green<<3)&0x07E0) | (c->Blue>>3);
+			}
+			if (PaletteMap[p] < 0) {
+				R->Failed = "too many colors";
+				R->Error = E_TGIF_ERR_DATA_TOO_BIG;
+				free(OutPixels);
+				DGifCloseFile(GifFile, &Error);
+				return -1;
+			}
 		}
 		OutPixels[i] = PaletteMap[p];
 	}
+	Img->Width = Width;
+	Img->Height = Height;
+	Img->Pixels = OutPixels;
+	DGifCloseFile(GifFile, &Error);
+	return 0;
+}
+
+/* Read all frames of in_name into A. Returns 0 if ok, otherwise fills in
+ * R->Failed. */
+static int LoadAnimation(const char *in_name, ConvertAnimation *A, ConvertResult *R) {
+	GifFileType *GifFile;
+	int Error;
+
+	A->Screens = NULL;
+	A->Delays = NULL;
+	if ((GifFile = ReadGif(in_name, R)) == NULL)
+		return -1;
+
+	const int Width = GifFile->SWidth, Height = GifFile->SHeight;
+	const int ScreenSize = Width * Height;
+	/* The screen the next frame is drawn onto, and the one from before the
+	 * frame that asks for it back */
+	uint8_t *Screen = malloc(ScreenSize + 1), *Saved = malloc(ScreenSize + 1);
+	A->Width = Width;
+	A->Height = Height;
+	A->FrameCount = GifFile->ImageCount;
+	A->Colors.ColorCount = 0;
+	A->Screens = malloc((size_t)ScreenSize * A->FrameCount + 1);
+	A->Delays = malloc(A->FrameCount * sizeof(uint16_t) + 1);
+	if (!Screen || !Saved || !A->Screens || !A->Delays) {
+		R->Failed = "alloc";
+		R->Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
+		goto fail;
+	}
+
+	/* Disposed frames leave the background color, or black without one */
+	const ColorMapObject *ScreenColors = GifFile->SColorMap;
+	const GifColorType Black = { 0, 0, 0 }, *c = &Black;
+	if (ScreenColors && GifFile->SBackGroundColor < ScreenColors->ColorCount)
+		c = &ScreenColors->Colors[GifFile->SBackGroundColor];
+	const int Background = MapColor(&A->Colors, -1, c->Red, c->Green, c->Blue);
+	memset(Screen, Background, ScreenSize);
+
+	for (int i = 0; i < A->FrameCount; i++) {
+		const SavedImage *Frame = &GifFile->SavedImages[i];
+		const GifImageDesc *Desc = &Frame->ImageDesc;
+		const ColorMapObject *InputColors = Desc->ColorMap ? Desc->ColorMap : ScreenColors;
+		GraphicsControlBlock GCB = { DISPOSAL_UNSPECIFIED, false, 0, NO_TRANSPARENT_COLOR };
+		int16_t PaletteMap[256];
+
+		if (!InputColors) {
+			R->Failed = "no colors";
+			R->Error = E_TGIF_ERR_NO_COLOR_MAP;
+			goto fail;
+		}
+		DGifSavedExtensionToGCB(GifFile, i, &GCB);
+		if (GCB.DisposalMode == DISPOSE_PREVIOUS)
+			memcpy(Saved, Screen, ScreenSize);
+
+		/* Same remapping as LoadImage, into the one palette, leaving the
+		 * transparent pixels what they were */
+		memset(PaletteMap, 0xFF, sizeof(PaletteMap));
+		for (int y = 0; y < Desc->Height && Desc->Top + y < Height; y++) {
+			const uint8_t *In = Frame->RasterBits + y * Desc->Width;
+			uint8_t *Out = Screen + (Desc->Top + y) * Width + Desc->Left;
+			for (int x = 0; x < Desc->Width && Desc->Left + x < Width; x++) {
+				uint8_t p = In[x];
+				if (p == GCB.TransparentColor) continue;
+				if (PaletteMap[p] < 0) {
+					c = &InputColors->Colors[p < InputColors->ColorCount ? p : 0];
+					PaletteMap[p] = MapColor(&A->Colors, -1, c->Red, c->Green, c->Blue);
+					if (PaletteMap[p] < 0) {
+						R->Failed = "too many colors";
+						R->Error = E_TGIF_ERR_DATA_TOO_BIG;
+						goto fail;
+					}
+				}
+				Out[x] = PaletteMap[p];
+			}
+		}
+		memcpy(A->Screens + (size_t)i * ScreenSize, Screen, ScreenSize);
+		A->Delays[i] = GCB.DelayTime;
+
+		if (GCB.DisposalMode == DISPOSE_BACKGROUND) {
+			for (int y = Desc->Top; y < Desc->Top + Desc->Height && y < Height; y++)
+				for (int x = Desc->Left; x < Desc->Left + Desc->Width && x < Width; x++)
+					Screen[y * Width + x] = Background;
+		} else if (GCB.DisposalMode == DISPOSE_PREVIOUS) {
+			memcpy(Screen, Saved, ScreenSize);
+		}
+	}
+
+	free(Screen);
+	free(Saved);
+	DGifCloseFile(GifFile, &Error);
+	return 0;
+
+fail:
+	free(Screen);
+	free(Saved);
+	free(A->Screens);
+	free(A->Delays);
+	A->Screens = NULL;
+	A->Delays = NULL;
+	DGifCloseFile(GifFile, &Error);
+	return -1;
+}
+
+/* Put the palette of Img in order of how many pixels have each color, most
+ * first (ties by RGB565 value), and renumber its pixels to match. Images of
+ * a family that look alike (background, outline, ...) then use the same
+ * indices for the same parts, as a preset dictionary trained on one needs. */
+static void SortColors(ConvertImage *Img) {
+	const int Count = Img->Colors.ColorCount;
+	const long PixelCount = (long)Img->Width * Img->Height;
+	TGifColorType Colors[256];
+	uint8_t Order[256], Map[256];
+	int64_t Key[256] = { 0 };
+
+	/* Most first is the smallest key */
+	for (long i = 0; i < PixelCount; i++)
+		Key[Img->Pixels[i]] -= 0x10000;
+	for (int i = 0; i < Count; i++) {
+		Key[i] += Img->Colors.Colors[i];
+		/* Insertion sort, palettes are small */
+		int j = i;
+		for (; j > 0 && Key[Order[j - 1]] > Key[i]; j--)
+			Order[j] = Order[j - 1];
+		Order[j] = i;
+	}
+	for (int i = 0; i < Count; i++) {
+		Colors[i] = Img->Colors.Colors[Order[i]];
+		Map[Order[i]] = i;
+	}
+	memcpy(Img->Colors.Colors, Colors, Count * sizeof(TGifColorType));
+	for (long i = 0; i < PixelCount; i++)
+		Img->Pixels[i] = Map[Img->Pixels[i]];
+	if (Img->Transparent >= 0)
+		Img->Transparent = Map[Img->Transparent];
+}
+
+/* Quantize TrueColor into Img, with Colors colors. Returns 0 if ok,
+ * otherwise fills in R->Failed. */
+static int QuantizeInto(const TrueColorImage *TrueColor, int Colors,
+		const ConvertOptions *Opt, ConvertImage *Img, ConvertResult *R) {
+	Img->Width = TrueColor->Width;
+	Img->Height = TrueColor->Height;
+	Img->Transparent = -1;
+	if (!Img->Pixels)
+		Img->Pixels = malloc(Img->Width * Img->Height);
+	if (!Img->Pixels ||
+	    QuantizeImage(TrueColor, Colors, Opt->Dither, &Img->Colors, Img->Pixels)) {
+		R->Failed = "alloc";
+		R->Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
+		return -1;
+	}
+	if (Opt->SortColors)
+		SortColors(Img);
+	return 0;
+}
+
+/* Encode Img for E->SRAMLimit with the (memory output) encoder TGif, which
+ * hands the image over in *Data, *DataLen. Fills in the rest of E. */
+static void EncodeWith(TGifFileType *TGif, TGifByteType **Data, size_t *DataLen,
+		const ConvertImage *Img, const ConvertOptions *Opt, const TGifByteType *Preset,
+		size_t PresetLen, Encoding *E) {
+	E->Data = NULL;
+	E->Points = NULL;
+	E->NumPoints = 0;
+	E->Error = 0;
+	if (TEGifSetRestartInterval(TGif, Opt->RestartRows) == TGIF_ERROR ||
+	    TEGifSetClearPolicy(TGif, Opt->ClearPolicy) == TGIF_ERROR ||
+	    TEGifSetParse(TGif, Opt->Parse) == TGIF_ERROR ||
+	    TEGifSetLossy(TGif, Opt->MaxError) == TGIF_ERROR ||
+	    TEGifSetTransparent(TGif, Img->Transparent) == TGIF_ERROR ||
+	    TEGifSetPreset(TGif, Preset, PresetLen) == TGIF_ERROR ||
+	    (Opt->Strips && TEGifSetStrips(TGif, Opt->Strips) == TGIF_ERROR) ||
+	    TEGifPutScreenDesc(TGif, Img->Width, Img->Height, &Img->Colors, E->SRAMLimit) == TGIF_ERROR ||
+	    TEGifPutLine(TGif, Img->Pixels, Img->Width * Img->Height) == TGIF_ERROR) {
+		E->Error = TGif->Error;
+		TEGifReset(TGif);    /* Drop whatever was encoded already */
+		free(*Data);
+		*Data = NULL;
+		return;
+	}
+	E->MaxCode = TGif->MaxCodeUsed;
+
+	/* The restart points only last until the reset */
+	const TGifRestartPoint *Points;
+	E->NumPoints = TEGifGetRestartPoints(TGif, &Points);
+	if (E->NumPoints) {
+		E->Points = malloc(E->NumPoints * sizeof(TGifRestartPoint));
+		if (E->Points)
+			memcpy(E->Points, Points, E->NumPoints * sizeof(TGifRestartPoint));
+		else
+			E->Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
+	}
+	if (TEGifReset(TGif) == TGIF_ERROR && !E->Error)
+		E->Error = TGif->Error;
+	E->Data = *Data;
+	E->Len = *DataLen;
+	*Data = NULL;
+}
+
+/* Same, with the preset dictionary if there is one and that comes out
+ * smaller: a strange image can do worse with it than without. */
+static void Encode(TGifFileType *TGif, TGifByteType **Data, size_t *DataLen,
+		const ConvertImage *Img, const ConvertOptions *Opt, Encoding *E) {
+	Encoding Without = *E;
+
+	EncodeWith(TGif, Data, DataLen, Img, Opt, Opt->Preset, Opt->PresetLen, E);
+	if (!Opt->Preset)
+		return;
+	EncodeWith(TGif, Data, DataLen, Img, Opt, NULL, 0, &Without);
+	if (!Without.Error && (E->Error || Without.Len < E->Len)) {
+		free(E->Data);
+		free(E->Points);
+		*E = Without;
+	} else {
+		free(Without.Data);
+		free(Without.Points);
+	}
+}
+
+/* Auto-tuning: every SRAM limit, shared out to the worker threads */
+typedef struct TuneJob {
+	const ConvertImage *Img;
+	const ConvertOptions *Opt;
+	Encoding *Candidates;
+	int Count;
+	int Next;
+} TuneJob;
+
+static void *TuneWorker(void *Arg) {
+	TuneJob *Job = Arg;
+	TGifByteType *Data = NULL;
+	size_t DataLen;
+	int Error, i;
+
+	TGifFileType *TGif = TEGifOpenMemory(&Data, &DataLen, &Error);
+	while ((i = __atomic_fetch_add(&Job->Next, 1, __ATOMIC_RELAXED)) < Job->Count) {
+		if (!TGif)
+			Job->Candidates[i].Error = Error;
+		else
+			Encode(TGif, &Data, &DataLen, Job->Img, Job->Opt, &Job->Candidates[i]);
+	}
+	if (TGif)
+		TEGifCloseFile(TGif, &Error);
+	return NULL;
+}
+
+/* Encode Img for every SRAM limit from 256 up to Opt->SRAMLimit, and pick
+ * the smallest output, or the least SRAM that fits Opt->Budget. The LZW
+ * output does not depend on the order of the palette (it is the same
+ * strings, under other names), so the SRAM limit is all there is to try. */
+static int Tune(const ConvertImage *Img, const ConvertOptions *Opt, Encoding *Best) {
+	Encoding Candidates[16];
+	TuneJob Job = { Img, Opt, Candidates, Opt->SRAMLimit / 256, 0 };
+	int Threads = Opt->Threads < Job.Count ? Opt->Threads : Job.Count;
+	int Pick = -1;
+
+	memset(Candidates, 0, sizeof(Candidates));
+	for (int i = 0; i < Job.Count; i++)
+		Candidates[i].SRAMLimit = (i + 1) * 256;
+
+	pthread_t Thread[Threads > 1 ? Threads - 1 : 1];
+	int Started;
+	for (Started = 0; Started < Threads - 1; Started++) {
+		if (pthread_create(&Thread[Started], NULL, TuneWorker, &Job))
+			break;
+	}
+	TuneWorker(&Job);
+	while (Started--)
+		pthread_join(Thread[Started], NULL);
+
+	for (int i = 0; i < Job.Count; i++) {
+		const Encoding *E = &Candidates[i];
+		if (E->Error || E->Len > MAX_TGIF_SIZE) continue;
+		if (Opt->Budget) {
+			if (E->Len <= (size_t)Opt->Budget) {
+				Pick = i;
+				break;
+			}
+		} else if (Pick < 0 || E->Len < Candidates[Pick].Len) {
+			Pick = i;
+		}
+	}
+
+	if (Opt->Curve) {
+		printf("  SRAM    bytes  maxcode\n");
+		for (int i = 0; i < Job.Count; i++) {
+			const Encoding *E = &Candidates[i];
+			if (E->Error)
+				printf("%6d   error %d\n", E->SRAMLimit, E->Error);
+			else
+				printf("%6d %8zu %8d%s%s\n", E->SRAMLimit, E->Len, E->MaxCode,
+					E->Len > MAX_TGIF_SIZE ? "  too big to decode" : "",
+					i == Pick ? "  <-" : "");
+		}
+	}
+
+	for (int i = 0; i < Job.Count; i++) {
+		if (i == Pick) continue;
+		free(Candidates[i].Data);
+		free(Candidates[i].Points);
+	}
+	if (Pick < 0)
+		return -1;
+	*Best = Candidates[Pick];
+	return 0;
+}
+
+/* Truecolor input under a budget: the most colors, up to Opt->Colors, that
+ * fit it. Fewer colors are (nearly always) fewer bytes, so if all of them
+ * do not fit this bisects. Leaves the best in Img and *Best. */
+static int TuneColors(const TrueColorImage *TrueColor, ConvertImage *Img,
+		const ConvertOptions *Opt, Encoding *Best, ConvertResult *R) {
+	int Lo = 2, Hi = Opt->Colors, Colors = Hi, Tried = 0, BestColors = 0;
+	Encoding E;
+
+	while (Lo <= Hi) {
+		if (QuantizeInto(TrueColor, Colors, Opt, Img, R))
+			break;
+		Tried = Colors;
+		if (Opt->Curve)
+			printf("%d colors:\n", Img->Colors.ColorCount);
+		if (!Tune(Img, Opt, &E)) {
+			free(Best->Data);
+			free(Best->Points);
+			*Best = E;
+			BestColors = Colors;
+			Lo = Colors + 1;
+		} else {
+			Hi = Colors - 1;
+		}
+		Colors = (Lo + Hi + 1) / 2;
+	}
+	if (!BestColors)
+		return -1;
+	/* Img goes with the last one tried */
+	if (BestColors != Tried && QuantizeInto(TrueColor, BestColors, Opt, Img, R))
+		return -1;
+	return 0;
+}
+
+/* Read in_name, a GIF or truecolor (quantized to Opt->Colors), into Img.
+ * TrueColor keeps the truecolor image, if it was one. Returns 0 if ok,
+ * otherwise fills in R->Failed. */
+static int LoadInput(const char *in_name, const ConvertOptions *Opt, ConvertImage *Img,
+		TrueColorImage *TrueColor, ConvertResult *R) {
+	Img->Pixels = NULL;
+	switch (ReadTrueColor(in_name, Opt->RawWidth, Opt->RawHeight, TrueColor)) {
+	case 0:
+		return QuantizeInto(TrueColor, Opt->Colors, Opt, Img, R);
+	case 1:
+		if (LoadImage(in_name, Img, R))
+			return -1;
+		if (Opt->SortColors)
+			SortColors(Img);
+		return 0;
+	default:
+		R->Failed = "read";
+		R->Error = D_GIF_ERR_READ_FAILED;
+		return -1;
+	}
+}
+
+/* Convert in_name into out_name with the (memory output) encoder TGif,
+ * which hands the image over in *Data, *DataLen. Returns 0 if ok. */
+static int Convert(TGifFileType *TGif, TGifByteType **Data, size_t *DataLen,
+		const char *in_name, const char *out_name, const ConvertOptions *Opt,
+		ConvertResult *R) {
+	ConvertImage Img;
+	TrueColorImage TrueColor;
+	Encoding E = { Opt->SRAMLimit, NULL, 0, 0, NULL, 0, 0 };
+	double t = NowMs();
+
+	memset(R, 0, sizeof(*R));
+	if (LoadInput(in_name, Opt, &Img, &TrueColor, R))
+		goto out;
+
+	if (TrueColor.RGB && Opt->Budget) {
+		if (TuneColors(&TrueColor, &Img, Opt, &E, R)) {
+			if (!R->Failed) {
+				R->Failed = "nothing fits the budget";
+				R->Error = E_TGIF_ERR_DATA_TOO_BIG;
+			}
+			goto out;
+		}
+	} else if (Opt->Auto) {
+		if (Tune(&Img, Opt, &E)) {
+			R->Failed = Opt->Budget ? "nothing fits the budget" : "nothing fits";
+			R->Error = E_TGIF_ERR_DATA_TOO_BIG;
+			goto out;
+		}
+	} else {
+		Encode(TGif, Data, DataLen, &Img, Opt, &E);
+		if (E.Error) {
+			R->Failed = "encode";
+			R->Error = E.Error;
+			goto out;
+		}
+	}
+	R->Width = Img.Width;
+	R->Height = Img.Height;
+	R->Colors = Img.Colors.ColorCount;
+	R->Transparent = Img.Transparent;
+	R->SRAMLimit = E.SRAMLimit;
+	R->MaxCode = E.MaxCode;
+	R->Restarts = E.NumPoints;
+
+	if ((Opt->RestartRows || Opt->Strips) &&
+	    WriteRestartPoints(out_name, E.Points, E.NumPoints)) {
+		R->Failed = "writing the restart points";
+		R->Error = E_TGIF_ERR_WRITE_FAILED;
+		goto out;
+	}
+	if (WriteFile(out_name, E.Data, 1, E.Len)) {
+		R->Failed = "write";
+		R->Error = E_TGIF_ERR_WRITE_FAILED;
+		goto out;
+	}
+	R->InBytes = Img.Width * Img.Height;
+	R->OutBytes = E.Len;
+
+out:
+	free(E.Data);
+	free(E.Points);
+	free(Img.Pixels);
+	free(TrueColor.RGB);
+	R->Ms = NowMs() - t;
+	return R->Failed ? -1 : 0;
+}
+
+static void PutWord(uint8_t *Out, uint16_t Word) {
+	Out[0] = Word & 0xFF;
+	Out[1] = Word >> 8;
+}
+
+/* Convert the animated GIF in_name into a tiny animation in out_name: the
+ * first frame all of it, the others only the rectangle that changed since
+ * the one before. A frame that changes nothing just adds its delay to the
+ * one before. Same arguments as Convert. */
+static int ConvertAnim(TGifFileType *TGif, TGifByteType **Data, size_t *DataLen,
+		const char *in_name, const char *out_name, const ConvertOptions *Opt,
+		ConvertResult *R) {
+	ConvertAnimation A;
+	ConvertImage Rect;
+	uint8_t *Out = malloc(MAX_TGIF_SIZE);
+	size_t Len = 0, LastFrame = 0;
+	double t = NowMs();
+
+	memset(R, 0, sizeof(*R));
+	Rect.Pixels = NULL;
+	if (LoadAnimation(in_name, &A, R))
+		goto out;
+	if (!A.FrameCount) {
+		/* Nothing a decoder would take as an animation */
+		R->Failed = "no frames";
+		R->Error = D_GIF_ERR_NO_IMAG_DSCR;
+		goto out;
+	}
+	const int ScreenSize = A.Width * A.Height;
+	const size_t HeaderSize = 4 + A.Colors.ColorCount * sizeof(TGifColorType);
+	Rect.Colors = A.Colors;
+	Rect.Transparent = -1;
+	Rect.Pixels = malloc(ScreenSize + 1);
+	if (!Out || !Rect.Pixels) {
+		R->Failed = "alloc";
+		R->Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
+		goto out;
+	}
+
+	for (int i = 0; i < A.FrameCount; i++) {
+		const uint8_t *Screen = A.Screens + (size_t)i * ScreenSize;
+		int X0 = 0, Y0 = 0, X1 = A.Width, Y1 = A.Height;
+
+		if (i) {
+			/* The bounding box of what changed */
+			const uint8_t *Before = Screen - ScreenSize;
+			X0 = A.Width;
+			Y0 = A.Height;
+			X1 = Y1 = 0;
+			for (int y = 0; y < A.Height; y++) {
+				for (int x = 0; x < A.Width; x++) {
+					if (Screen[y * A.Width + x] == Before[y * A.Width + x]) continue;
+					if (x < X0) X0 = x;
+					if (x >= X1) X1 = x + 1;
+					if (y < Y0) Y0 = y;
+					Y1 = y + 1;
+				}
+			}
+			if (X1 <= X0) {
+				unsigned Delay = (Out[LastFrame] | (Out[LastFrame + 1] << 8)) + A.Delays[i];
+				PutWord(Out + LastFrame, Delay > 0xFFFF ? 0xFFFF : Delay);
+				continue;
+			}
+		}
+
+		Rect.Width = X1 - X0;
+		Rect.Height = Y1 - Y0;
+		for (int y = 0; y < Rect.Height; y++)
+			memcpy(Rect.Pixels + y * Rect.Width, Screen + (Y0 + y) * A.Width + X0, Rect.Width);
+		Encoding E = { Opt->SRAMLimit, NULL, 0, 0, NULL, 0, 0 };
+		Encode(TGif, Data, DataLen, &Rect, Opt, &E);
+		if (E.Error) {
+			R->Failed = "encode";
+			R->Error = E.Error;
+			goto out;
+		}
+
+		/* Frame 0 is the whole screen, so its header (and palette) is the
+		 * one of the animation, and every frame leaves them out */
+		if (!i) {
+			memcpy(Out, TGIF_ANIM_MAGIC, 2);
+			memcpy(Out + 2, E.Data, 4);
+			memcpy(Out + TGIF_ANIM_HEADER_SIZE, E.Data + 4, HeaderSize - 4);
+			Len = TGIF_ANIM_HEADER_SIZE + HeaderSize - 4;
+		}
+		size_t FrameLen = E.Len - HeaderSize;
+		if (Len + TGIF_FRAME_HEADER_SIZE + FrameLen > MAX_TGIF_SIZE) {
+			free(E.Data);
+			R->Failed = "too big";
+			R->Error = E_TGIF_ERR_DATA_TOO_BIG;
+			goto out;
+		}
+		LastFrame = Len;
+		PutWord(Out + Len, A.Delays[i]);
+		PutWord(Out + Len + 2, X0);
+		PutWord(Out + Len + 4, Y0);
+		PutWord(Out + Len + 6, Rect.Width);
+		PutWord(Out + Len + 8, Rect.Height);
+		PutWord(Out + Len + 10, FrameLen);
+		memcpy(Out + Len + TGIF_FRAME_HEADER_SIZE, E.Data + HeaderSize, FrameLen);
+		Len += TGIF_FRAME_HEADER_SIZE + FrameLen;
+		if (E.MaxCode > R->MaxCode)
+			R->MaxCode = E.MaxCode;
+		R->Frames++;
+		free(E.Data);
+		free(E.Points);
+	}
+	PutWord(Out + 6, R->Frames);
+
+	if (WriteFile(out_name, Out, 1, Len)) {
+		R->Failed = "write";
+		R->Error = E_TGIF_ERR_WRITE_FAILED;
+		goto out;
+	}
+	R->Width = A.Width;
+	R->Height = A.Height;
+	R->Colors = A.Colors.ColorCount;
+	R->Transparent = -1;
+	R->SRAMLimit = Opt->SRAMLimit;
+	R->InBytes = (long)ScreenSize * A.FrameCount;
+	R->OutBytes = Len;
+
+out:
+	free(Out);
+	free(Rect.Pixels);
+	free(A.Screens);
+	free(A.Delays);
+	R->Ms = NowMs() - t;
+	return R->Failed ? -1 : 0;
+}
+
+/* Batch mode: a list of jobs shared by the worker threads */
+typedef struct BatchJob {
+	char **In, **Out;
+	ConvertResult *Results;
+	int Count;
+	const ConvertOptions *Opt;
+	int Next;
+} BatchJob;
+
+static void *BatchWorker(void *Arg) {
+	BatchJob *Job = Arg;
+	TGifByteType *Data = NULL;
+	size_t DataLen;
+	int Error, i;
+
+	/* One encoder per thread, reused for every image it takes */
+	TGifFileType *TGif = TEGifOpenMemory(&Data, &DataLen, &Error);
+	/* Take images until there are none left, so no thread sits idle
+	 * while another still has a queue of big ones. */
+	while ((i = __atomic_fetch_add(&Job->Next, 1, __ATOMIC_RELAXED)) < Job->Count) {
+		if (!TGif) {
+			Job->Results[i].Failed = "encoder setup";
+			Job->Results[i].Error = Error;
+			continue;
+		}
+		if (Job->Opt->Anim)
+			ConvertAnim(TGif, &Data, &DataLen, Job->In[i], Job->Out[i], Job->Opt, &Job->Results[i]);
+		else
+			Convert(TGif, &Data, &DataLen, Job->In[i], Job->Out[i], Job->Opt, &Job->Results[i]);
+	}
+	if (TGif)
+		TEGifCloseFile(TGif, &Error);
+	free(Data);
+	return NULL;
+}
+
+/* Whether name is one of the inputs we take: a GIF, or truecolor */
+static bool IsInputName(const char *name) {
+	static const char *const Extensions[] = { ".gif", ".ppm", ".pam", ".rgb" };
+	int len = strlen(name);
+	for (unsigned i = 0; i < sizeof(Extensions) / sizeof(Extensions[0]); i++)
+		if (len > 4 && !strcasecmp(name + len - 4, Extensions[i])) return true;
+	return false;
+}
+
+static int AddInput(BatchJob *Job, int *Size, const char *in_name, const char *out_dir) {
+	if (Job->Count == *Size) {
+		*Size = *Size ? *Size * 2 : 64;
+		Job->In = realloc(Job->In, *Size * sizeof(char *));
+		Job->Out = realloc(Job->Out, *Size * sizeof(char *));
+		if (!Job->In || !Job->Out) return -1;
+	}
+	/* <out dir>/<name without .gif (or .ppm, ...)>.bin */
+	const char *base = strrchr(in_name, '/');
+	base = base ? base + 1 : in_name;
+	int len = strlen(base);
+	if (IsInputName(base)) len -= 4;
+	char *out = malloc(strlen(out_dir) + len + 6);
+	if (!out) return -1;
+	sprintf(out, "%s/%.*s.bin", out_dir, len, base);
+	Job->In[Job->Count] = strdup(in_name);
+	Job->Out[Job->Count++] = out;
+	return 0;
+}
+
+static int CompareNames(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* The inputs: every .gif, .ppm, .pam and .rgb in a directory (in name order), or one file name
+ * per line of a list */
+static int ReadInputs(BatchJob *Job, const char *src, const char *out_dir) {
+	int Size = 0;
+	DIR *d = opendir(src);
+	if (d) {
+		struct dirent *e;
+		char **names = NULL;
+		int count = 0, r = 0;
+		while ((e = readdir(d))) {
+			if (!IsInputName(e->d_name)) continue;
+			char **n = realloc(names, (count + 1) * sizeof(char *));
+			if (!n) break;
+			names = n;
+			names[count++] = strdup(e->d_name);
+		}
+		closedir(d);
+		qsort(names, count, sizeof(char *), CompareNames);
+		for (int i = 0; i < count; i++) {
+			char name[strlen(src) + strlen(names[i]) + 2];
+			sprintf(name, "%s/%s", src, names[i]);
+			if (!r && AddInput(Job, &Size, name, out_dir)) r = -1;
+			free(names[i]);
+		}
+		free(names);
+		return r;
+	}
+	FILE *f = fopen(src, "r");
+	if (!f) return -1;
+	char line[4096];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (!line[0] || line[0] == '#') continue;
+		if (AddInput(Job, &Size, line, out_dir)) {
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static int Batch(const char *src, const char *out_dir, const ConvertOptions *Opt, int threads) {
+	BatchJob Job = { NULL, NULL, NULL, 0, Opt, 0 };
+	if (ReadInputs(&Job, src, out_dir)) {
+		fprintf(stderr, "Cannot read the inputs from '%s'\n", src);
+		return EXIT_FAILURE;
+	}
+	Job.Results = calloc(Job.Count ? Job.Count : 1, sizeof(ConvertResult));
+	if (threads < 1) threads = 1;
+	if (threads > Job.Count) threads = Job.Count ? Job.Count : 1;
+
+	double t = NowMs();
+	pthread_t Thread[threads];
+	int Started;
+	for (Started = 0; Started < threads - 1; Started++) {
+		if (pthread_create(&Thread[Started], NULL, BatchWorker, &Job))
+			break;
+	}
+	BatchWorker(&Job);    /* This thread does its share too. */
+	while (Started--)
+		pthread_join(Thread[Started], NULL);
+	t = NowMs() - t;
+
+	/* The report, in input order */
+	int Failed = 0;
+	long InBytes = 0, OutBytes = 0;
+	double CpuMs = 0;
+	printf("%-32s %9s %6s %6s %8s %8s %7s %9s\n", "image", "size", "colors", "sram", "bytes", "maxcode", "points", "ms");
+	for (int i = 0; i < Job.Count; i++) {
+		const ConvertResult *R = &Job.Results[i];
+		if (R->Failed) {
+			printf("%-32s FAILED: %s (error %d)\n", Job.In[i], R->Failed, R->Error);
+			Failed++;
+		} else {
+			char size[24];
+			sprintf(size, "%dx%d", R->Width, R->Height);
+			printf("%-32s %9s %6d %6d %8ld %8d %7d %9.2f\n", Job.In[i], size, R->Colors,
+				R->SRAMLimit, R->OutBytes, R->MaxCode, R->Restarts, R->Ms);
+			InBytes += R->InBytes;
+			OutBytes += R->OutBytes;
+		}
+		CpuMs += R->Ms;
+		free(Job.In[i]);
+		free(Job.Out[i]);
+	}
+	printf("%d images, %d failed: %ld pixels into %ld bytes (%.1f%%)\n",
+		Job.Count, Failed, InBytes, OutBytes, InBytes ? 100.0 * OutBytes / InBytes : 0.0);
+	printf("%.1f ms on %d threads, %.1f ms of conversions (%.2fx)\n",
+		t, threads, CpuMs, t > 0 ? CpuMs / t : 0.0);
+	free(Job.In);
+	free(Job.Out);
+	free(Job.Results);
+	return Failed ? EXIT_FAILURE : 0;
+}
+
+/* Archive mode: where image colors go in palette Palette (which they may
+ * add to), in Map. Returns how many colors that adds. Every color of the
+ * image gets an entry of its own, as the transparent one may look just
+ * like another. */
+static int MapInto(const TColorMapObject *Palette, const ConvertImage *Img, uint8_t *Map) {
+	bool Taken[256] = { false };
+	int Added = 0;
+
+	for (int i = 0; i < Img->Colors.ColorCount; i++) {
+		int j;
+		for (j = 0; j < Palette->ColorCount; j++)
+			if (Palette->Colors[j] == Img->Colors.Colors[i] && !Taken[j]) break;
+		if (j == Palette->ColorCount)
+			j = Palette->ColorCount + Added++;
+		if (j < 256)
+			Taken[j] = true;
+		Map[i] = j;
+	}
+	return Added;
+}
+
+/* One image of an archive, as it goes in */
+typedef struct ArchiveImage {
+	uint8_t Header[4];
+	uint16_t ExtPalette;
+	TGifByteType *Data;   /* Extensions, code count byte and LZW data */
+	size_t Len;
+} ArchiveImage;
+
+/* Keep what of encoding E goes in an archive: everything but the header
+ * and the palette of Colors colors */
+static void ArchiveKeep(ArchiveImage *A, Encoding *E, int Palette, int Colors) {
+	/* The extensions stay, in front of the data */
+	int Exts = 0;
+	while (!E->Data[Exts * TGIF_EXT_SIZE] && !E->Data[Exts * TGIF_EXT_SIZE + 1])
+		Exts++;
+	const size_t ExtLen = Exts * TGIF_EXT_SIZE, Skip = ExtLen + 4 + Colors * sizeof(TGifColorType);
+	memcpy(A->Header, E->Data + ExtLen, 4);
+	memmove(E->Data + ExtLen, E->Data + Skip, E->Len - Skip);
+	A->ExtPalette = TGIF_AR_EXTPALETTE(Exts, Palette);
+	A->Data = E->Data;
+	A->Len = E->Len - Skip + ExtLen;
+	E->Data = NULL;
+}
+
+static void PutLong(uint8_t *Out, uint32_t Long) {
+	PutWord(Out, Long & 0xFFFF);
+	PutWord(Out + 2, Long >> 16);
+}
 
-	if (argc==4) {
-		sram_limit = atoi(argv[3]);
-		if (!sram_limit) {
+static size_t Align(size_t Len) {
+	return (Len + TGIF_ARCHIVE_ALIGN - 1) & ~(size_t)(TGIF_ARCHIVE_ALIGN - 1);
+}
+
+/* Put all the images of src (a directory or list, as for Batch) into one
+ * tiny archive out_name, with Ids 0, 1, 2... in that order. An image either
+ * uses the palette that already has the most of its colors, adding the
+ * others, or starts a new one, whichever comes out smaller. */
+static int Archive(const char *src, const char *out_name, const ConvertOptions *Opt) {
+	BatchJob Job = { NULL, NULL, NULL, 0, Opt, 0 };
+	TColorMapObject *Palettes = NULL;
+	ArchiveImage *Images = NULL;
+	ConvertImage Img, Shared;
+	TrueColorImage TrueColor;
+	ConvertResult R;
+	TGifByteType *Data = NULL;
+	uint8_t *Out = NULL;
+	size_t DataLen;
+	int Error, PaletteCount = 0, Done = 0, Result = EXIT_FAILURE;
+	long Separate = 0;
+	uint8_t Map[256];
+
+	Img.Pixels = Shared.Pixels = NULL;
+	TrueColor.RGB = NULL;
+	TGifFileType *TGif = TEGifOpenMemory(&Data, &DataLen, &Error);
+	if (!TGif) {
+		PrintGifError(Error);
+		return EXIT_FAILURE;
+	}
+	if (ReadInputs(&Job, src, ".")) {
+		fprintf(stderr, "Cannot read the inputs from '%s'\n", src);
+		goto out;
+	}
+	if (Job.Count > 0xFFFF) {
+		fprintf(stderr, "Too many images\n");
+		goto out;
+	}
+	Images = calloc(Job.Count + 1, sizeof(ArchiveImage));
+	Palettes = malloc((Job.Count + 1) * sizeof(TColorMapObject));
+	if (!Images || !Palettes) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+
+	printf("%-32s %5s %9s %6s %7s %8s\n", "image", "id", "size", "colors", "palette", "bytes");
+	for (Done = 0; Done < Job.Count; Done++) {
+		const char *in_name = Job.In[Done];
+		Encoding Own = { Opt->SRAMLimit, NULL, 0, 0, NULL, 0, 0 },
+			S = { Opt->SRAMLimit, NULL, 0, 0, NULL, 0, 0 };
+
+		memset(&R, 0, sizeof(R));
+		free(Img.Pixels);
+		free(TrueColor.RGB);
+		if (LoadInput(in_name, Opt, &Img, &TrueColor, &R))
+			goto failed;
+		Encode(TGif, &Data, &DataLen, &Img, Opt, &Own);
+		if (Own.Error) {
+			R.Failed = "encode";
+			R.Error = Own.Error;
+			goto failed;
+		}
+		Separate += Own.Len;
+
+		/* The palette it adds the fewest colors to, if it fits */
+		int Best = -1, BestAdded = 257;
+		for (int p = 0; p < PaletteCount; p++) {
+			int Added = MapInto(&Palettes[p], &Img, Map);
+			if (Added < BestAdded && Palettes[p].ColorCount + Added <= 256) {
+				Best = p;
+				BestAdded = Added;
+			}
+		}
+		if (Best >= 0) {
+			/* Only as many colors as it needs, so codes stay short */
+			MapInto(&Palettes[Best], &Img, Map);
+			Shared.Width = Img.Width;
+			Shared.Height = Img.Height;
+			Shared.Colors = Palettes[Best];
+			Shared.Colors.ColorCount = 0;
+			for (int i = 0; i < Img.Colors.ColorCount; i++) {
+				Shared.Colors.Colors[Map[i]] = Img.Colors.Colors[i];
+				if (Map[i] >= Shared.Colors.ColorCount)
+					Shared.Colors.ColorCount = Map[i] + 1;
+			}
+			Shared.Transparent = Img.Transparent >= 0 ? Map[Img.Transparent] : -1;
+			free(Shared.Pixels);
+			Shared.Pixels = malloc(Img.Width * Img.Height);
+			if (Shared.Pixels) {
+				for (int i = 0; i < Img.Width * Img.Height; i++)
+					Shared.Pixels[i] = Map[Img.Pixels[i]];
+				Encode(TGif, &Data, &DataLen, &Shared, Opt, &S);
+			}
+			/* A new palette costs its colors and its offset */
+			if (!S.Data || S.Len - Shared.Colors.ColorCount * sizeof(TGifColorType) +
+			    BestAdded * sizeof(TGifColorType) >= Own.Len + 4)
+				Best = -1;
+		}
+		if (Best >= 0) {
+			ArchiveKeep(&Images[Done], &S, Best, Shared.Colors.ColorCount);
+			Palettes[Best].ColorCount += BestAdded;
+			memcpy(Palettes[Best].Colors, Shared.Colors.Colors,
+				Palettes[Best].ColorCount * sizeof(TGifColorType));
+		} else {
+			ArchiveKeep(&Images[Done], &Own, PaletteCount, Img.Colors.ColorCount);
+			Best = PaletteCount;
+			Palettes[PaletteCount++] = Img.Colors;
+		}
+		free(Own.Data);
+		free(Own.Points);
+		free(S.Data);
+		free(S.Points);
+
+		char size[24];
+		sprintf(size, "%dx%d", Img.Width, Img.Height);
+		printf("%-32s %5d %9s %6d %7d %8zu\n", in_name, Done, size, Img.Colors.ColorCount,
+			Best, Images[Done].Len);
+		continue;
+failed:
+		fprintf(stderr, "Converting '%s' failed: %s\n", in_name, R.Failed);
+		PrintGifError(R.Error);
+		goto out;
+	}
+	if (PaletteCount > TGIF_AR_PALETTE(0xFFFF) + 1) {
+		fprintf(stderr, "Too many palettes\n");
+		goto out;
+	}
+
+	/* Where everything goes */
+	const size_t Directory = TGIF_ARCHIVE_HEADER_SIZE + (size_t)Job.Count * TGIF_ARCHIVE_ENTRY_SIZE;
+	size_t Len = Align(Directory + PaletteCount * 4);
+	for (int p = 0; p < PaletteCount; p++)
+		Len = Align(Len + Palettes[p].ColorCount * sizeof(TGifColorType));
+	for (int i = 0; i < Job.Count; i++)
+		Len += Images[i].Len;
+	if (Len > 0xFFFFFFFF || (Out = calloc(Len, 1)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+	memcpy(Out, TGIF_ARCHIVE_MAGIC, 2);
+	PutWord(Out + 2, Job.Count);
+	PutWord(Out + 4, PaletteCount);
+	Len = Align(Directory + PaletteCount * 4);
+	for (int p = 0; p < PaletteCount; p++) {
+		PutLong(Out + Directory + p * 4, Len);
+		memcpy(Out + Len, Palettes[p].Colors, Palettes[p].ColorCount * sizeof(TGifColorType));
+		Len = Align(Len + Palettes[p].ColorCount * sizeof(TGifColorType));
+	}
+	for (int i = 0; i < Job.Count; i++) {
+		uint8_t *Entry = Out + TGIF_ARCHIVE_HEADER_SIZE + i * TGIF_ARCHIVE_ENTRY_SIZE;
+		PutWord(Entry, i);
+		memcpy(Entry + 2, Images[i].Header, 4);
+		PutWord(Entry + 6, Images[i].ExtPalette);
+		PutLong(Entry + 8, Len);
+		memcpy(Out + Len, Images[i].Data, Images[i].Len);
+		Len += Images[i].Len;
+	}
+	if (WriteFile(out_name, Out, 1, Len)) {
+		fprintf(stderr, "Writing '%s' failed\n", out_name);
+		goto out;
+	}
+	printf("%d images, %d palettes: %zu bytes (%ld as separate files)\n",
+		Job.Count, PaletteCount, Len, Separate);
+	Result = 0;
+
+out:
+	for (int i = 0; i < Job.Count; i++) {
+		if (Images)
+			free(Images[i].Data);
+		free(Job.In[i]);
+		free(Job.Out[i]);
+	}
+	free(Job.In);
+	free(Job.Out);
+	free(Images);
+	free(Palettes);
+	free(Out);
+	free(Img.Pixels);
+	free(Shared.Pixels);
+	free(TrueColor.RGB);
+	TEGifCloseFile(TGif, &Error);
+	free(Data);
+	return Result;
+}
+
+/* The bytes all of Images (Count of them) take, encoded with Opt */
+static long EncodedSize(TGifFileType *TGif, TGifByteType **Data, size_t *DataLen,
+		const ConvertImage *Images, int Count, const ConvertOptions *Opt) {
+	long Total = 0;
+
+	for (int i = 0; i < Count; i++) {
+		Encoding E = { Opt->SRAMLimit, NULL, 0, 0, NULL, 0, 0 };
+		Encode(TGif, Data, DataLen, &Images[i], Opt, &E);
+		if (E.Error)
+			return -1;
+		Total += E.Len;
+		free(E.Data);
+		free(E.Points);
+	}
+	return Total;
+}
+
+/* Train a preset dictionary on the images of src (a directory or list, as
+ * for Batch) into out_name. More entries are not always better, as they
+ * make every code longer, so it tries up to Entries, halving them, and
+ * keeps the one that gets the images the smallest. */
+static int Train(const char *src, const char *out_name, const ConvertOptions *Opt, int Entries) {
+	BatchJob Job = { NULL, NULL, NULL, 0, Opt, 0 };
+	ConvertImage *Images = NULL;
+	uint8_t **Pixels = NULL, *Best = NULL;
+	unsigned long *Lens = NULL;
+	TrueColorImage TrueColor;
+	ConvertResult R;
+	ConvertOptions With = *Opt;
+	TGifByteType *Data = NULL;
+	size_t DataLen, BestLen = 0;
+	long Without, Size, BestSize = -1;
+	int Error, Loaded = 0, Result = EXIT_FAILURE;
+
+	TGifFileType *TGif = TEGifOpenMemory(&Data, &DataLen, &Error);
+	if (!TGif) {
+		PrintGifError(Error);
+		return EXIT_FAILURE;
+	}
+	if (ReadInputs(&Job, src, ".")) {
+		fprintf(stderr, "Cannot read the inputs from '%s'\n", src);
+		goto out;
+	}
+	Images = malloc((Job.Count + 1) * sizeof(ConvertImage));
+	Pixels = malloc((Job.Count + 1) * sizeof(uint8_t *));
+	Lens = malloc((Job.Count + 1) * sizeof(unsigned long));
+	if (!Images || !Pixels || !Lens) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+	for (Loaded = 0; Loaded < Job.Count; Loaded++) {
+		memset(&R, 0, sizeof(R));
+		int Failed = LoadInput(Job.In[Loaded], Opt, &Images[Loaded], &TrueColor, &R);
+		free(TrueColor.RGB);
+		if (Failed) {
+			fprintf(stderr, "Converting '%s' failed: %s\n", Job.In[Loaded], R.Failed);
+			PrintGifError(R.Error);
+			goto out;
+		}
+		Pixels[Loaded] = Images[Loaded].Pixels;
+		Lens[Loaded] = (unsigned long)Images[Loaded].Width * Images[Loaded].Height;
+	}
+
+	With.Preset = NULL;
+	if ((Without = EncodedSize(TGif, &Data, &DataLen, Images, Job.Count, &With)) < 0) {
+		fprintf(stderr, "Encoding failed\n");
+		goto out;
+	}
+	printf("%7s %8s\n", "entries", "bytes");
+	printf("%7d %8ld\n", 0, Without);
+	for (; Entries >= 16; Entries /= 2) {
+		uint8_t *Preset;
+		size_t Len;
+		if (TrainPreset(Pixels, Lens, Job.Count, Entries, &Preset, &Len)) {
+			fprintf(stderr, "Out of memory\n");
+			goto out;
+		}
+		With.Preset = Preset;
+		With.PresetLen = Len;
+		Size = EncodedSize(TGif, &Data, &DataLen, Images, Job.Count, &With);
+		printf("%7d %8ld\n", Preset[4] | (Preset[5] << 8), Size);
+		if (Size >= 0 && (BestSize < 0 || Size < BestSize)) {
+			free(Best);
+			Best = Preset;
+			BestLen = Len;
+			BestSize = Size;
+		} else {
+			free(Preset);
+		}
+	}
+	if (!Best) {
+		fprintf(stderr, "Encoding failed\n");
+		goto out;
+	}
+	if (WriteFile(out_name, Best, 1, BestLen)) {
+		fprintf(stderr, "Writing '%s' failed\n", out_name);
+		goto out;
+	}
+	printf("%d images: %ld bytes with the %d entry preset (id %d, %zu bytes), %ld without\n",
+		Job.Count, BestSize, Best[4] | (Best[5] << 8), Best[2], BestLen, Without);
+	Result = 0;
+
+out:
+	for (int i = 0; i < Loaded; i++)
+		free(Images[i].Pixels);
+	for (int i = 0; i < Job.Count; i++) {
+		free(Job.In[i]);
+		free(Job.Out[i]);
+	}
+	free(Job.In);
+	free(Job.Out);
+	free(Images);
+	free(Pixels);
+	free(Lens);
+	free(Best);
+	TEGifCloseFile(TGif, &Error);
+	free(Data);
+	return Result;
+}
+
+/* Read the preset dictionary out of name, *Len bytes. NULL if it is not
+ * one. */
+static TGifByteType *ReadPreset(const char *name, size_t *Len) {
+	FILE *f = fopen(name, "rb");
+	TGifByteType *Preset = malloc(TGIF_PRESET_HEADER_SIZE + 3 * TGIF_PRESET_MAX_ENTRIES + 1);
+
+	*Len = 0;
+	if (f && Preset)
+		*Len = fread(Preset, 1, TGIF_PRESET_HEADER_SIZE + 3 * TGIF_PRESET_MAX_ENTRIES + 1, f);
+	if (f)
+		fclose(f);
+	if (*Len < TGIF_PRESET_HEADER_SIZE || memcmp(Preset, TGIF_PRESET_MAGIC, 2) ||
+	    *Len != TGIF_PRESET_HEADER_SIZE + 3 * (size_t)(Preset[4] | (Preset[5] << 8))) {
+		free(Preset);
+		return NULL;
+	}
+	return Preset;
+}
+
+int main(int argc, char** argv) {
+	ConvertOptions Opt = { 3072, 0, 0, TEGIF_CLEAR_FULL, TEGIF_PARSE_GREEDY, 0, false, 0, 1, false,
+		256, false, 0, 0, false, NULL, 0, false };
+	int batch = 0, archive = 0, train = 0, threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *preset_name = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:s:bj:am:cfl:q:dg:ApT:P:")) != -1) {
+		switch (opt) {
+		case 'r': Opt.RestartRows = atoi(optarg); break;
+		case 's': Opt.Strips = atoi(optarg); break;
+		case 'b': batch = 1; break;
+		case 'j': threads = atoi(optarg); break;
+		case 'a': Opt.Auto = true; break;
+		case 'm': Opt.Auto = true; Opt.Budget = atol(optarg); break;
+		case 'c': Opt.ClearPolicy = TEGIF_CLEAR_ADAPTIVE; break;
+		case 'f': Opt.Parse = TEGIF_PARSE_FLEXIBLE; break;
+		case 'l': Opt.MaxError = atoi(optarg); break;
+		case 'q': Opt.Colors = atoi(optarg); break;
+		case 'd': Opt.Dither = true; break;
+		case 'A': Opt.Anim = true; break;
+		case 'p': archive = 1; break;
+		case 'T': train = atoi(optarg); if (train < 1) Usage(argv[0]); break;
+		case 'P': preset_name = optarg; break;
+		case 'g':
+			if (sscanf(optarg, "%dx%d", &Opt.RawWidth, &Opt.RawHeight) != 2 ||
+			    Opt.RawWidth < 1 || Opt.RawHeight < 1)
+				Usage(argv[0]);
+			break;
+		default: Usage(argv[0]);
+		}
+	}
+	if ((argc - optind < 2)||(argc - optind > 3)) Usage(argv[0]);
+	if (Opt.Anim && (Opt.Auto || Opt.RestartRows || Opt.Strips)) {
+		fprintf(stderr, "-A does not go with -a, -m, -r or -s\n");
+		exit(EXIT_FAILURE);
+	}
+	if (archive && (batch || Opt.Auto || Opt.RestartRows || Opt.Strips || Opt.Anim)) {
+		fprintf(stderr, "-p does not go with -b, -a, -m, -r, -s or -A\n");
+		exit(EXIT_FAILURE);
+	}
+	if (train && (batch || archive || Opt.Auto || Opt.Anim || preset_name)) {
+		fprintf(stderr, "-T does not go with -b, -p, -a, -m, -A or -P\n");
+		exit(EXIT_FAILURE);
+	}
+	if (preset_name && Opt.Anim) {
+		fprintf(stderr, "-P does not go with -A\n");
+		exit(EXIT_FAILURE);
+	}
+	if (preset_name && (Opt.Preset = ReadPreset(preset_name, &Opt.PresetLen)) == NULL) {
+		fprintf(stderr, "'%s' is not a preset dictionary\n", preset_name);
+		exit(EXIT_FAILURE);
+	}
+	Opt.SortColors = train || preset_name;
+	if (Opt.Colors < 2 || Opt.Colors > 256) {
+		fprintf(stderr, "Invalid number of colors\n");
+		exit(EXIT_FAILURE);
+	}
+	const char *in_name = argv[optind];
+	const char *out_name = argv[optind + 1];
+	const char *sram_arg = argc - optind == 3 ? argv[optind + 2] : NULL;
+
+	if (Opt.Auto)
+		Opt.SRAMLimit = 4096;
+	if (sram_arg) {
+		Opt.SRAMLimit = atoi(sram_arg);
+		if (!Opt.SRAMLimit || (Opt.Auto && (Opt.SRAMLimit < 256 || Opt.SRAMLimit > 4096))) {
 			fprintf(stderr, "Invalid SRAM bytes number\n");
 			exit(EXIT_FAILURE);
 		}
 	}
 
+	/* Batches are parallel over the images, single images over the
+	 * SRAM limits tried */
+	if (batch)
+		return Batch(in_name, out_name, &Opt, threads);
+	if (archive)
+		return Archive(in_name, out_name, &Opt);
+	if (train)
+		return Train(in_name, out_name, &Opt, train);
+	Opt.Threads = threads;
+	Opt.Curve = true;
 
-	printf("Processing %dx%d image with %d colors\n", Width, Height, TGifColors.ColorCount);
-	printf("Setting up to encode for a decoder with %d bytes of SRAM\n", sram_limit);
+	int Error;
+	TGifByteType *Data = NULL;
+	size_t DataLen;
+	TGifFileType *TGif = TEGifOpenMemory(&Data, &DataLen, &Error);
 
-	if (TEGifPutScreenDesc(TGif, Width, Height, &TGifColors, sram_limit) == TGIF_ERROR) {
-		PrintGifError(TGif->Error);
+	if (!TGif) {
+		/* This is crude hack, but the codes should actually match :P */
+		PrintGifError(Error);
 		exit(EXIT_FAILURE);
 	}
 
-	if (TEGifPutLine(TGif, OutPixels, PixelCount) == TGIF_ERROR) {
-		PrintGifError(TGif->Error);
+	ConvertResult R;
+	if ((Opt.Anim ? ConvertAnim : Convert)(TGif, &Data, &DataLen, in_name, out_name, &Opt, &R)) {
+		fprintf(stderr, "Converting '%s' failed: %s\n", in_name, R.Failed);
+		PrintGifError(R.Error);
+		TEGifCloseFile(TGif, &Error);
 		exit(EXIT_FAILURE);
 	}
-	int MaxCode = TGif->MaxCodeUsed;
+
+	if (Opt.Anim)
+		printf("Processing %dx%d animation with %d colors, %d frames\n", R.Width, R.Height, R.Colors, R.Frames);
+	else
+		printf("Processing %dx%d image with %d colors\n", R.Width, R.Height, R.Colors);
+	if (R.Transparent >= 0)
+		printf("Color %d is transparent\n", R.Transparent);
+	printf("Setting up to encode for a decoder with %d bytes of SRAM\n", R.SRAMLimit);
+	if (Opt.RestartRows || Opt.Strips)
+		printf("Wrote %d restart points\n", R.Restarts);
 	if (TEGifCloseFile(TGif, &Error) == TGIF_ERROR) {
 		PrintGifError(Error);
 		exit(EXIT_FAILURE);
 	}
 
-	printf("Everything is ok (max code used=%d)\n", MaxCode);
+	printf("Everything is ok (max code used=%d)\n", R.MaxCode);
 	return 0;
 }
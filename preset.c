@@ -0,0 +1,255 @@
+/******************************************************************************
+preset.c - training a preset dictionary for the converter
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tgif_lib.h"
+#include "preset.h"
+
+/* Rounds of parsing the images with the last round's preset */
+#define PRESET_ROUNDS 4
+/* Strings we keep track of, at most */
+#define PRESET_MAX_NODES (1 << 21)
+
+/* Every string the images' dictionaries had, as a trie: nodes 0..255 are
+ * the pixels, the others a parent string plus a pixel. */
+typedef struct PresetTrie {
+    int Count, Size;
+    int32_t *Parent;
+    uint8_t *Pixel;
+    uint32_t *Depth;        /* Length of the string */
+    uint32_t *Uses;         /* Times it was output as a code this round */
+    uint32_t *Stamp;        /* Last image whose dictionary it was in, */
+    int32_t *Entry;         /* or its entry in the preset, -1 if none */
+    uint32_t *Children;     /* Hash of the nodes by parent and pixel, + 1 */
+    uint32_t HashMask;
+} PresetTrie;
+
+/* A string worth having, for sorting */
+typedef struct PresetCandidate {
+    uint64_t Score;
+    int32_t Node;
+} PresetCandidate;
+
+static uint32_t HashChild(const PresetTrie *T, int32_t Parent, uint8_t Pixel)
+{
+    return (((uint32_t)Parent << 8 | Pixel) * 2654435761u) & T->HashMask;
+}
+
+/******************************************************************************
+ Room for Size strings, with all the pixels in already. Returns 0 if ok.    *
+******************************************************************************/
+static int TrieInit(PresetTrie *T, int Size)
+{
+    uint32_t HashSize = 1;
+
+    while (HashSize < 2 * (uint32_t)Size)
+        HashSize <<= 1;
+    T->Size = Size;
+    T->HashMask = HashSize - 1;
+    T->Parent = malloc(Size * sizeof(int32_t));
+    T->Pixel = malloc(Size);
+    T->Depth = malloc(Size * sizeof(uint32_t));
+    T->Uses = calloc(Size, sizeof(uint32_t));
+    T->Stamp = calloc(Size, sizeof(uint32_t));
+    T->Entry = malloc(Size * sizeof(int32_t));
+    T->Children = calloc(HashSize, sizeof(uint32_t));
+    if (!T->Parent || !T->Pixel || !T->Depth || !T->Uses || !T->Stamp ||
+        !T->Entry || !T->Children)
+        return -1;
+    for (T->Count = 0; T->Count < 256; T->Count++) {
+        T->Parent[T->Count] = -1;
+        T->Pixel[T->Count] = T->Count;
+        T->Depth[T->Count] = 1;
+        T->Entry[T->Count] = -1;
+    }
+    return 0;
+}
+
+static void TrieFree(PresetTrie *T)
+{
+    free(T->Parent);
+    free(T->Pixel);
+    free(T->Depth);
+    free(T->Uses);
+    free(T->Stamp);
+    free(T->Entry);
+    free(T->Children);
+}
+
+/******************************************************************************
+ The string Parent followed by Pixel: its node, or where it would go in    *
+ Children.								      *
+******************************************************************************/
+static uint32_t TrieSlot(const PresetTrie *T, int32_t Parent, uint8_t Pixel)
+{
+    uint32_t Slot = HashChild(T, Parent, Pixel), Node;
+
+    while ((Node = T->Children[Slot]) != 0 &&
+           (T->Parent[Node - 1] != Parent || T->Pixel[Node - 1] != Pixel))
+        Slot = (Slot + 1) & T->HashMask;
+    return Slot;
+}
+
+/******************************************************************************
+ Parse the image like the encoder would, its dictionary starting out as    *
+ the preset, and count the strings output. The new strings of this image's *
+ dictionary are the ones stamped Stamp.					      *
+******************************************************************************/
+static void TrieParse(PresetTrie *T, const uint8_t *Pixels, unsigned long Len,
+                      uint32_t Stamp)
+{
+    int32_t Crnt = Pixels[0], Node;
+    uint32_t Slot;
+
+    for (unsigned long i = 1; i < Len; i++) {
+        Slot = TrieSlot(T, Crnt, Pixels[i]);
+        Node = (int32_t)T->Children[Slot] - 1;
+        if (Node >= 0 && (T->Entry[Node] >= 0 || T->Stamp[Node] == Stamp)) {
+            Crnt = Node;
+            continue;
+        }
+        T->Uses[Crnt]++;
+        if (Node < 0 && T->Count < T->Size) {
+            Node = T->Count++;
+            T->Parent[Node] = Crnt;
+            T->Pixel[Node] = Pixels[i];
+            T->Depth[Node] = T->Depth[Crnt] + 1;
+            T->Entry[Node] = -1;
+            T->Children[Slot] = Node + 1;
+        }
+        if (Node >= 0)
+            T->Stamp[Node] = Stamp;
+        Crnt = Pixels[i];
+    }
+    T->Uses[Crnt]++;
+}
+
+static int CompareCandidates(const void *a, const void *b)
+{
+    const PresetCandidate *A = a, *B = b;
+
+    if (A->Score != B->Score)
+        return A->Score < B->Score ? 1 : -1;
+    return A->Node - B->Node;
+}
+
+/******************************************************************************
+ Pick the preset: the strings that saved the most pixels this round (every  *
+ use of one does the work of its last Depth - 1 pixels), with all of their  *
+ prefixes, which it needs. Into Nodes, prefixes first, and their Entry.     *
+ Returns how many.							      *
+******************************************************************************/
+static int TrieSelect(PresetTrie *T, int Entries, int32_t *Nodes)
+{
+    PresetCandidate *Candidates = malloc((T->Count - 255) * sizeof(PresetCandidate));
+    int Count = 0, Selected = 0, Missing, i, j;
+    int32_t Node;
+
+    for (Node = 0; Node < T->Count; Node++)
+        T->Entry[Node] = -1;
+    if (!Candidates)
+        return -1;
+    for (Node = 256; Node < T->Count; Node++) {
+        if (!T->Uses[Node])
+            continue;
+        Candidates[Count].Score = (uint64_t)T->Uses[Node] * (T->Depth[Node] - 1);
+        Candidates[Count++].Node = Node;
+    }
+    qsort(Candidates, Count, sizeof(PresetCandidate), CompareCandidates);
+
+    for (i = 0; i < Count && Selected < Entries; i++) {
+        Missing = 0;
+        for (Node = Candidates[i].Node; Node >= 256 && T->Entry[Node] < 0; Node = T->Parent[Node])
+            Missing++;
+        if (!Missing || Selected + Missing > Entries)
+            continue;
+        for (Node = Candidates[i].Node; Node >= 256 && T->Entry[Node] < 0; Node = T->Parent[Node]) {
+            T->Entry[Node] = 0;
+            Nodes[Selected++] = Node;
+        }
+    }
+    free(Candidates);
+
+    /* Shorter strings first, so prefixes come before what builds on them */
+    for (i = 1; i < Selected; i++) {
+        Node = Nodes[i];
+        for (j = i; j > 0 && T->Depth[Nodes[j - 1]] > T->Depth[Node]; j--)
+            Nodes[j] = Nodes[j - 1];
+        Nodes[j] = Node;
+    }
+    for (i = 0; i < Selected; i++)
+        T->Entry[Nodes[i]] = i;
+    return Selected;
+}
+
+int TrainPreset(uint8_t *const *Pixels, const unsigned long *Lens, int Count,
+                int Entries, uint8_t **Preset, size_t *Len)
+{
+    PresetTrie T;
+    int32_t Nodes[TGIF_PRESET_MAX_ENTRIES];
+    unsigned long Total = 0;
+    int Selected = 0, MaxPixel = 0, Round, i;
+    uint32_t MaxLen = 1, Stamp = 0;
+    uint8_t *Out, Id = 0x55;
+
+    if (Entries > TGIF_PRESET_MAX_ENTRIES)
+        Entries = TGIF_PRESET_MAX_ENTRIES;
+    for (i = 0; i < Count; i++)
+        Total += Lens[i];
+    if (Total > PRESET_MAX_NODES / PRESET_ROUNDS)
+        Total = PRESET_MAX_NODES / PRESET_ROUNDS;
+    memset(&T, 0, sizeof(T));
+    if (TrieInit(&T, 256 + Total * PRESET_ROUNDS)) {
+        TrieFree(&T);
+        return -1;
+    }
+
+    for (Round = 0; Round < PRESET_ROUNDS; Round++) {
+        memset(T.Uses, 0, T.Count * sizeof(uint32_t));
+        for (i = 0; i < Count; i++)
+            if (Lens[i])
+                TrieParse(&T, Pixels[i], Lens[i], ++Stamp);
+        if ((Selected = TrieSelect(&T, Entries, Nodes)) < 0) {
+            TrieFree(&T);
+            return -1;
+        }
+    }
+
+    *Len = TGIF_PRESET_HEADER_SIZE + 3 * Selected;
+    if ((Out = malloc(*Len)) == NULL) {
+        TrieFree(&T);
+        return -1;
+    }
+    for (i = 0; i < Selected; i++) {
+        int32_t Node = Nodes[i], Parent = T.Parent[Node];
+        int Prefix = Parent < 256 ? Parent : 256 + T.Entry[Parent];
+        Out[TGIF_PRESET_HEADER_SIZE + 2 * i] = Prefix & 0xFF;
+        Out[TGIF_PRESET_HEADER_SIZE + 2 * i + 1] = Prefix >> 8;
+        Out[TGIF_PRESET_HEADER_SIZE + 2 * Selected + i] = T.Pixel[Node];
+        if (T.Pixel[Node] > MaxPixel)
+            MaxPixel = T.Pixel[Node];
+        if (Parent < 256 && Parent > MaxPixel)
+            MaxPixel = Parent;
+        if (T.Depth[Node] > MaxLen)
+            MaxLen = T.Depth[Node];
+    }
+    memcpy(Out, TGIF_PRESET_MAGIC, 2);
+    Out[3] = MaxPixel;
+    Out[4] = Selected & 0xFF;
+    Out[5] = Selected >> 8;
+    Out[6] = MaxLen & 0xFF;
+    Out[7] = MaxLen >> 8;
+    /* The Id tells presets apart, so it comes from all the rest */
+    for (size_t n = 0; n < *Len; n++)
+        if (n != 2)
+            Id = (Id ^ Out[n]) * 167 + 13;
+    Out[2] = Id;
+
+    TrieFree(&T);
+    *Preset = Out;
+    return 0;
+}
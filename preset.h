@@ -0,0 +1,18 @@
+#pragma once
+
+/******************************************************************************
+preset.h - training a preset dictionary (see tgif_lib.h) for the converter,
+on a set of images that are alike
+*****************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Trains a preset dictionary of at most Entries (up to
+ * TGIF_PRESET_MAX_ENTRIES) entries on the Count images Pixels[i], of
+ * Lens[i] palette indices each, into *Preset, a malloc()ed buffer of *Len
+ * bytes. It gets the strings that the images' own dictionaries keep
+ * needing, and an Id from its contents. Returns 0 if ok, -1 if out of
+ * memory. */
+int TrainPreset(uint8_t *const *Pixels, const unsigned long *Lens, int Count,
+                int Entries, uint8_t **Preset, size_t *Len);
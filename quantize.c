@@ -0,0 +1,512 @@
+/******************************************************************************
+quantize.c - truecolor input for the converter
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "quantize.h"
+
+/* Same as the decoder and the encoder's limit */
+#define MAX_DIMENSION 1023
+
+#define RGB565(r, g, b) ((((r) << 8) & 0xF800) | (((g) << 3) & 0x07E0) | ((b) >> 3))
+#define RGB565_R(c) ((((c) >> 8) & 0xF8) | ((c) >> 13))
+#define RGB565_G(c) ((((c) >> 3) & 0xFC) | (((c) >> 9) & 0x03))
+#define RGB565_B(c) ((((c) << 3) & 0xF8) | (((c) >> 2) & 0x07))
+
+/* The colors of an image (or a palette), one array per channel */
+typedef struct QuantColors {
+    int Count;
+    int32_t *R, *G, *B;
+    uint32_t *Weight;       /* Pixels of each */
+    uint16_t Start[256];    /* Palettes: sorted by G, the first with G >= g */
+} QuantColors;
+
+/* A median cut box: Colors[Start..End), sorted along Axis when split. */
+typedef struct QuantBox {
+    int Start, End;
+    int Axis;               /* Channel with the most variance */
+    double Error;           /* Squared error if it were one color */
+} QuantBox;
+
+static const uint8_t Bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+/******************************************************************************
+ Reads the next PPM header token (skipping whitespace and comments) into    *
+ Buf. Returns 0 if ok.							      *
+******************************************************************************/
+static int ReadToken(FILE *f, char *Buf, int Size)
+{
+    int c, Len = 0;
+
+    do {
+        c = getc(f);
+        if (c == '#')
+            while (c != '\n' && c != EOF)
+                c = getc(f);
+    } while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+    while (c != EOF && c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+        if (Len < Size - 1)
+            Buf[Len++] = c;
+        c = getc(f);
+    }
+    /* The whitespace after the last token (MAXVAL) is the last byte of
+     * the header, so nothing more is read */
+    Buf[Len] = 0;
+    return Len ? 0 : -1;
+}
+
+/******************************************************************************
+ Reads the PAM header lines up to ENDHDR. Returns 0 if ok.		      *
+******************************************************************************/
+static int ReadPamHeader(FILE *f, int *Width, int *Height, int *Depth,
+                         int *MaxVal)
+{
+    char Line[256], Key[32];
+    int Value;
+
+    while (fgets(Line, sizeof(Line), f)) {
+        if (Line[0] == '#' || Line[0] == '\n')
+            continue;
+        if (!strncmp(Line, "ENDHDR", 6))
+            return 0;
+        if (sscanf(Line, "%31s %d", Key, &Value) != 2)
+            continue;           /* TUPLTYPE, which the depth tells us */
+        if (!strcmp(Key, "WIDTH")) *Width = Value;
+        else if (!strcmp(Key, "HEIGHT")) *Height = Value;
+        else if (!strcmp(Key, "DEPTH")) *Depth = Value;
+        else if (!strcmp(Key, "MAXVAL")) *MaxVal = Value;
+    }
+    return -1;
+}
+
+/******************************************************************************
+ Reads Width x Height pixels of Depth samples each into Img->RGB, scaled    *
+ from 0..MaxVal to 0..255. Gray (and gray + alpha) comes out as gray RGB,   *
+ and the alpha of RGB_ALPHA is dropped. Returns 0 if ok.		      *
+******************************************************************************/
+static int ReadSamples(FILE *f, int Depth, int MaxVal, TrueColorImage *Img)
+{
+    const int SampleBytes = MaxVal > 255 ? 2 : 1;
+    const size_t RowBytes = (size_t)Img->Width * Depth * SampleBytes;
+    uint8_t *Row = malloc(RowBytes);
+    uint8_t *Out = Img->RGB;
+
+    if (!Row)
+        return -1;
+    for (int y = 0; y < Img->Height; y++) {
+        if (fread(Row, 1, RowBytes, f) != RowBytes) {
+            free(Row);
+            return -1;
+        }
+        for (int x = 0; x < Img->Width; x++) {
+            for (int c = 0; c < 3; c++) {
+                /* Gray: the one sample, three times */
+                int s = (x * Depth + (Depth < 3 ? 0 : c)) * SampleBytes;
+                unsigned v = SampleBytes == 2 ? (Row[s] << 8) | Row[s + 1] : Row[s];
+                if (v > (unsigned)MaxVal)
+                    v = MaxVal;
+                *Out++ = MaxVal == 255 ? v : (v * 255 + MaxVal / 2) / MaxVal;
+            }
+        }
+    }
+    free(Row);
+    return 0;
+}
+
+int ReadTrueColor(const char *FileName, int RawWidth, int RawHeight,
+                  TrueColorImage *Img)
+{
+    int Width = 0, Height = 0, Depth = 3, MaxVal = 255;
+    char Magic[3] = { 0 }, Token[16];
+    FILE *f = fopen(FileName, "rb");
+
+    Img->RGB = NULL;
+    if (!f)
+        return 1;               /* giflib tells why */
+
+    if (fread(Magic, 1, 2, f) != 2 || Magic[0] != 'P' ||
+        (Magic[1] != '6' && Magic[1] != '7')) {
+        /* Anything but a GIF is raw, if we have a size for it */
+        if (!RawWidth || !memcmp(Magic, "GI", 2)) {
+            fclose(f);
+            return 1;
+        }
+        rewind(f);
+        Width = RawWidth;
+        Height = RawHeight;
+    } else if (Magic[1] == '6') {
+        if (ReadToken(f, Token, sizeof(Token)) || !(Width = atoi(Token)) ||
+            ReadToken(f, Token, sizeof(Token)) || !(Height = atoi(Token)) ||
+            ReadToken(f, Token, sizeof(Token)) || !(MaxVal = atoi(Token)))
+            goto fail;
+    } else if (ReadPamHeader(f, &Width, &Height, &Depth, &MaxVal)) {
+        goto fail;
+    }
+    if (Width < 1 || Width > MAX_DIMENSION || Height < 1 ||
+        Height > MAX_DIMENSION || Depth < 1 || Depth > 4 ||
+        MaxVal < 1 || MaxVal > 65535)
+        goto fail;
+
+    Img->Width = Width;
+    Img->Height = Height;
+    Img->RGB = malloc((size_t)Width * Height * 3);
+    if (!Img->RGB || ReadSamples(f, Depth, MaxVal, Img))
+        goto fail;
+    fclose(f);
+    return 0;
+
+fail:
+    free(Img->RGB);
+    Img->RGB = NULL;
+    fclose(f);
+    return -1;
+}
+
+static int AllocColors(QuantColors *C, int Count)
+{
+    C->Count = 0;
+    C->R = malloc(Count * sizeof(int32_t));
+    C->G = malloc(Count * sizeof(int32_t));
+    C->B = malloc(Count * sizeof(int32_t));
+    C->Weight = malloc(Count * sizeof(uint32_t));
+    return C->R && C->G && C->B && C->Weight ? 0 : -1;
+}
+
+static void FreeColors(QuantColors *C)
+{
+    free(C->R);
+    free(C->G);
+    free(C->B);
+    free(C->Weight);
+}
+
+/******************************************************************************
+ Sorts Palette by G (an insertion sort, it is at most 256 colors and mostly *
+ sorted already) and fills in Palette->Start for NearestColor.		      *
+******************************************************************************/
+static void SortPalette(QuantColors *Palette)
+{
+    int i, j, g;
+
+    for (i = 1; i < Palette->Count; i++) {
+        int32_t r = Palette->R[i], gg = Palette->G[i], b = Palette->B[i];
+        for (j = i; j > 0 && Palette->G[j - 1] > gg; j--) {
+            Palette->R[j] = Palette->R[j - 1];
+            Palette->G[j] = Palette->G[j - 1];
+            Palette->B[j] = Palette->B[j - 1];
+        }
+        Palette->R[j] = r;
+        Palette->G[j] = gg;
+        Palette->B[j] = b;
+    }
+    for (g = 0, i = 0; g < 256; g++) {
+        while (i < Palette->Count - 1 && Palette->G[i] < g)
+            i++;
+        Palette->Start[g] = i;
+    }
+}
+
+/******************************************************************************
+ Index of the color of (sorted) Palette closest to r, g, b. Starting at the *
+ colors with about the same G and going both ways, until G alone is further *
+ off than the best so far: mostly a few dozen colors instead of all 256.    *
+******************************************************************************/
+static int NearestColor(const QuantColors *Palette, int32_t r, int32_t g,
+                        int32_t b)
+{
+    int32_t BestDist = INT32_MAX;
+    int Best = 0, i;
+
+    for (i = Palette->Start[g]; i < Palette->Count; i++) {
+        int32_t dg = Palette->G[i] - g, dr, db, d;
+        if (dg * dg >= BestDist)
+            break;
+        dr = Palette->R[i] - r;
+        db = Palette->B[i] - b;
+        d = dr * dr + dg * dg + db * db;
+        if (d < BestDist) {
+            BestDist = d;
+            Best = i;
+        }
+    }
+    for (i = Palette->Start[g] - 1; i >= 0; i--) {
+        int32_t dg = Palette->G[i] - g, dr, db, d;
+        if (dg * dg >= BestDist)
+            break;
+        dr = Palette->R[i] - r;
+        db = Palette->B[i] - b;
+        d = dr * dr + dg * dg + db * db;
+        if (d < BestDist) {
+            BestDist = d;
+            Best = i;
+        }
+    }
+    return Best;
+}
+
+/******************************************************************************
+ Fills in Box->Axis and Box->Error from the colors in it.		      *
+******************************************************************************/
+static void MeasureBox(const QuantColors *C, QuantBox *Box)
+{
+    double n = 0, Sum[3] = { 0 }, Sum2[3] = { 0 }, Var[3];
+
+    for (int i = Box->Start; i < Box->End; i++) {
+        double w = C->Weight[i];
+        n += w;
+        Sum[0] += w * C->R[i];
+        Sum[1] += w * C->G[i];
+        Sum[2] += w * C->B[i];
+        Sum2[0] += w * C->R[i] * C->R[i];
+        Sum2[1] += w * C->G[i] * C->G[i];
+        Sum2[2] += w * C->B[i] * C->B[i];
+    }
+    Box->Axis = 0;
+    for (int c = 0; c < 3; c++) {
+        Var[c] = Sum2[c] - Sum[c] * Sum[c] / n;
+        if (Var[c] > Var[Box->Axis])
+            Box->Axis = c;
+    }
+    Box->Error = Box->End - Box->Start > 1 ? Var[0] + Var[1] + Var[2] : 0;
+}
+
+/******************************************************************************
+ Sorts the colors of Box along its axis (a counting sort, the channels are  *
+ 8 bit) and splits it at the weighted median into Box and *Upper.	      *
+******************************************************************************/
+static void SplitBox(QuantColors *C, QuantColors *Tmp, QuantBox *Box,
+                     QuantBox *Upper)
+{
+    const int32_t *Key = Box->Axis == 0 ? C->R : Box->Axis == 1 ? C->G : C->B;
+    int Start[257] = { 0 };
+    uint64_t Total = 0, Half = 0;
+    int i, Split;
+
+    for (i = Box->Start; i < Box->End; i++) {
+        Start[Key[i] + 1]++;
+        Total += C->Weight[i];
+    }
+    for (i = 0; i < 256; i++)
+        Start[i + 1] += Start[i];
+    for (i = Box->Start; i < Box->End; i++) {
+        int j = Box->Start + Start[Key[i]]++;
+        Tmp->R[j] = C->R[i];
+        Tmp->G[j] = C->G[i];
+        Tmp->B[j] = C->B[i];
+        Tmp->Weight[j] = C->Weight[i];
+    }
+    i = Box->End - Box->Start;
+    memcpy(C->R + Box->Start, Tmp->R + Box->Start, i * sizeof(int32_t));
+    memcpy(C->G + Box->Start, Tmp->G + Box->Start, i * sizeof(int32_t));
+    memcpy(C->B + Box->Start, Tmp->B + Box->Start, i * sizeof(int32_t));
+    memcpy(C->Weight + Box->Start, Tmp->Weight + Box->Start, i * sizeof(uint32_t));
+
+    /* Both halves get at least one color */
+    for (Split = Box->Start + 1; Split < Box->End - 1; Split++) {
+        Half += C->Weight[Split - 1];
+        if (Half * 2 >= Total)
+            break;
+    }
+    Upper->Start = Split;
+    Upper->End = Box->End;
+    Box->End = Split;
+    MeasureBox(C, Box);
+    MeasureBox(C, Upper);
+}
+
+/******************************************************************************
+ Picks at most Count colors for the (distinct) colors C into Palette: median *
+ cut, always splitting the box with the biggest error, then k-means rounds  *
+ until nothing moves (or enough rounds).				      *
+******************************************************************************/
+#define KMEANS_ROUNDS 8
+
+static int PickPalette(QuantColors *C, int Count, QuantColors *Palette)
+{
+    QuantBox Boxes[256];
+    QuantColors Tmp;
+    int NumBoxes = 1;
+
+    if (AllocColors(&Tmp, C->Count)) {
+        FreeColors(&Tmp);
+        return -1;
+    }
+    Boxes[0].Start = 0;
+    Boxes[0].End = C->Count;
+    MeasureBox(C, &Boxes[0]);
+    while (NumBoxes < Count) {
+        int Worst = 0;
+        for (int i = 1; i < NumBoxes; i++)
+            if (Boxes[i].Error > Boxes[Worst].Error)
+                Worst = i;
+        if (Boxes[Worst].Error <= 0)
+            break;
+        SplitBox(C, &Tmp, &Boxes[Worst], &Boxes[NumBoxes++]);
+    }
+    FreeColors(&Tmp);
+
+    /* Each box's weighted mean is its color */
+    uint8_t *Owner = malloc(C->Count);
+    double (*Sum)[4] = malloc(NumBoxes * sizeof(*Sum));
+    if (!Owner || !Sum) {
+        free(Owner);
+        free(Sum);
+        return -1;
+    }
+    for (int k = 0; k < NumBoxes; k++)
+        for (int i = Boxes[k].Start; i < Boxes[k].End; i++)
+            Owner[i] = k;
+    Palette->Count = NumBoxes;
+    for (int Round = 0; Round <= KMEANS_ROUNDS; Round++) {
+        int Moved = 0;
+        if (Round) {
+            SortPalette(Palette);
+            for (int i = 0; i < C->Count; i++)
+                Owner[i] = NearestColor(Palette, C->R[i], C->G[i], C->B[i]);
+        }
+        memset(Sum, 0, NumBoxes * sizeof(*Sum));
+        for (int i = 0; i < C->Count; i++) {
+            double w = C->Weight[i];
+            Sum[Owner[i]][0] += w * C->R[i];
+            Sum[Owner[i]][1] += w * C->G[i];
+            Sum[Owner[i]][2] += w * C->B[i];
+            Sum[Owner[i]][3] += w;
+        }
+        for (int k = 0; k < NumBoxes; k++) {
+            if (!Sum[k][3])
+                continue;       /* Lost all its colors, keep it where it is */
+            int32_t r = Sum[k][0] / Sum[k][3] + 0.5,
+                    g = Sum[k][1] / Sum[k][3] + 0.5,
+                    b = Sum[k][2] / Sum[k][3] + 0.5;
+            Moved += r != Palette->R[k] || g != Palette->G[k] || b != Palette->B[k];
+            Palette->R[k] = r;
+            Palette->G[k] = g;
+            Palette->B[k] = b;
+        }
+        if (Round && !Moved)
+            break;
+    }
+    free(Owner);
+    free(Sum);
+
+    /* And what it will look like on the screen */
+    for (int k = 0; k < NumBoxes; k++) {
+        uint16_t c = RGB565(Palette->R[k], Palette->G[k], Palette->B[k]);
+        Palette->R[k] = RGB565_R(c);
+        Palette->G[k] = RGB565_G(c);
+        Palette->B[k] = RGB565_B(c);
+    }
+    SortPalette(Palette);
+    return 0;
+}
+
+int QuantizeImage(const TrueColorImage *Img, int Colors, bool Dither,
+                  TColorMapObject *Palette, uint8_t *Pixels)
+{
+    const size_t PixelCount = (size_t)Img->Width * Img->Height;
+    uint32_t *Histogram = calloc(65536, sizeof(uint32_t));
+    int16_t *Map = malloc(65536 * sizeof(int16_t));
+    QuantColors Distinct = { 0 }, Picked = { 0 };
+    int Result = -1;
+
+    if (Colors < 2) Colors = 2;
+    if (Colors > 256) Colors = 256;
+    if (!Histogram || !Map)
+        goto out;
+
+    /* Everything ends up RGB565, so that is all the precision we need */
+    const uint8_t *p = Img->RGB;
+    for (size_t i = 0; i < PixelCount; i++, p += 3)
+        Histogram[RGB565(p[0], p[1], p[2])]++;
+    int Count = 0;
+    for (int c = 0; c < 65536; c++)
+        Count += Histogram[c] != 0;
+    if (AllocColors(&Distinct, Count) || AllocColors(&Picked, 256))
+        goto out;
+    for (int c = 0; c < 65536; c++) {
+        if (!Histogram[c]) continue;
+        Distinct.R[Distinct.Count] = RGB565_R(c);
+        Distinct.G[Distinct.Count] = RGB565_G(c);
+        Distinct.B[Distinct.Count] = RGB565_B(c);
+        Distinct.Weight[Distinct.Count++] = Histogram[c];
+    }
+
+    /* Few enough colors already: those, exactly */
+    if (Count <= Colors) {
+        Dither = false;
+        memcpy(Picked.R, Distinct.R, Count * sizeof(int32_t));
+        memcpy(Picked.G, Distinct.G, Count * sizeof(int32_t));
+        memcpy(Picked.B, Distinct.B, Count * sizeof(int32_t));
+        Picked.Count = Count;
+        SortPalette(&Picked);
+    } else if (PickPalette(&Distinct, Colors, &Picked)) {
+        goto out;
+    }
+
+    /* Dither by about half the distance between the palette colors, as if
+     * they were a regular grid */
+    int Spread = 0;
+    if (Dither) {
+        int Steps = 1;
+        while (Steps * Steps * Steps < Picked.Count)
+            Steps++;
+        Spread = 256 / Steps;
+    }
+
+    /* Then each pixel to its nearest palette color, looked up once for
+     * each RGB565 value that comes up. The palette gets only the colors
+     * used, in the order they come first (as LoadImage does), with any that
+     * ended up the same in RGB565 combined. */
+    int16_t Index[256];
+    memset(Map, 0xFF, 65536 * sizeof(int16_t));
+    memset(Index, 0xFF, sizeof(Index));
+    Palette->ColorCount = 0;
+    p = Img->RGB;
+    for (int y = 0; y < Img->Height; y++) {
+        for (int x = 0; x < Img->Width; x++, p += 3) {
+            int r = p[0], g = p[1], b = p[2];
+            if (Dither) {
+                int d = ((Bayer8[y & 7][x & 7] * 2 + 1 - 64) * Spread) / 128;
+                r += d; g += d; b += d;
+                r = r < 0 ? 0 : r > 255 ? 255 : r;
+                g = g < 0 ? 0 : g > 255 ? 255 : g;
+                b = b < 0 ? 0 : b > 255 ? 255 : b;
+            }
+            uint16_t c = RGB565(r, g, b);
+            if (Map[c] < 0)
+                Map[c] = NearestColor(&Picked, RGB565_R(c), RGB565_G(c), RGB565_B(c));
+            int k = Map[c];
+            if (Index[k] < 0) {
+                uint16_t Color = RGB565(Picked.R[k], Picked.G[k], Picked.B[k]);
+                int i;
+                for (i = 0; i < Palette->ColorCount; i++)
+                    if (Palette->Colors[i] == Color) break;
+                if (i == Palette->ColorCount)
+                    Palette->Colors[Palette->ColorCount++] = Color;
+                Index[k] = i;
+            }
+            *Pixels++ = Index[k];
+        }
+    }
+    Result = 0;
+
+out:
+    FreeColors(&Distinct);
+    FreeColors(&Picked);
+    free(Histogram);
+    free(Map);
+    return Result;
+}
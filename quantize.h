@@ -0,0 +1,31 @@
+#pragma once
+
+/******************************************************************************
+quantize.h - truecolor input for the converter: reading PPM/PAM/raw RGB and
+quantizing it down to a Tiny GIF palette
+*****************************************************************************/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tegif_lib.h"
+
+/* 3 bytes (R, G, B) per pixel, row by row */
+typedef struct TrueColorImage {
+    int Width, Height;
+    uint8_t *RGB;
+} TrueColorImage;
+
+/* Reads a binary PPM (P6) or PAM (P7, RGB or RGB_ALPHA, the alpha is
+ * dropped) into Img. If RawWidth and RawHeight are given, anything but a
+ * GIF is raw RGB of that size. Returns 0 if ok, 1 if the file is none of
+ * those (try giflib instead) and -1 if it is one but cannot be read. */
+int ReadTrueColor(const char *FileName, int RawWidth, int RawHeight,
+                  TrueColorImage *Img);
+
+/* Quantizes Img to at most Colors (2..256) RGB565 colors into Palette, with
+ * one palette index per pixel in Pixels. Median cut, refined with a few
+ * rounds of k-means. Dither adds an ordered (8x8 Bayer) dither.
+ * Returns 0 if ok, -1 if out of memory. */
+int QuantizeImage(const TrueColorImage *Img, int Colors, bool Dither,
+                  TColorMapObject *Palette, uint8_t *Pixels);
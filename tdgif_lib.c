@@ -14,7 +14,6 @@ tdgif_lib.c - Tiny "GIF" decoding
 #ifdef __AVR
 #include <avr/pgmspace.h>
 #include <avr/io.h>
-typedef __uint24 uint24_t;
 #define printf()
 
 #ifdef USE_ALLOCA
@@ -40,32 +39,23 @@ static uint8_t alloca_check(uint16_t size) {
 
 #else
 #include <stdio.h>
-typedef uint32_t uint24_t;
 #define PROGMEM
 #define pgm_read_byte(addr) (*(const unsigned char *)(addr))
 #define pgm_read_word(addr) (*(const unsigned short *)(addr))
 #define ALLOC(x) malloc(x)
 #define FREE(x) free(x)
+#if defined(__x86_64__) && defined(__GNUC__)
+/* The gather is built for AVX2 whatever the -m flags, and picked at run time */
+#define TDGIF_AVX2
+#include <immintrin.h>
+#endif
+#ifndef TDGIF_NO_THREADS
+#include <pthread.h>
+#endif
+#ifndef TDGIF_NARROW_INPUT
+#define TDGIF_WIDE_INPUT
+#endif
 #endif
-
-typedef struct TDGifPrivateType {
-    TGifInfo *Info;
-    uint16_t *Prefix;
-    uint16_t
-        ReadOffset,
-        ClearCode,   /* The CLEAR LZ code. */
-        RunningCode, /* The next code algorithm can generate. */
-        MaxCode1,    /* 1 bigger than max. possible code, in RunningBits bits. */
-        MaxCodePoint,
-	DictBase,
-	DictSize;
-    uint24_t CrntShiftDWord;   /* For bytes decomposition into codes. */
-    uint8_t
-        RunningBits,
-        InitCodeBits,
-	MaxCodeBits,
-        CrntShiftState;    /* Number of bits in CrntShiftDWord. */
-} TDGifPrivateType;
 
 /* Just byte access */
 static uint8_t TDGifReadByte(const void* base, uint16_t offset) {
@@ -73,20 +63,69 @@ static uint8_t TDGifReadByte(const void* base, uint16_t offset) {
 	return pgm_read_byte(d+offset);
 }
 
+static uint16_t TDGifReadWord(const void* base, uint16_t offset) {
+	return TDGifReadByte(base, offset) | (TDGifReadByte(base, offset + 1) << 8);
+}
+
+
+/* The next input byte: from the refill buffer in RAM or straight from flash */
+#ifdef __AVR
+#define TDGifFetch(Private, p) ((Private)->InRam ? *(p) : pgm_read_byte(p))
+#else
+#define TDGifFetch(Private, p) (*(p))
+#endif
 
+/******************************************************************************
+ Get the next block of input into InPtr..InEnd. Directly addressable images
+ have all of their data there from the start, so this only ever does
+ something for images read through a TGifSource.
+******************************************************************************/
 static int
-TDGifInput(TDGifPrivateType *Private, uint8_t *NextByte)
+TDGifRefill(TDGifState *Private)
 {
-    if (Private->ReadOffset >= Private->Info->MaxSz) {
-	Private->Info->Error = D_TGIF_ERR_MAXSZ;
+    TGifInfo *Info = Private->Info;
+    const TGifSource *Source = Info->Source;
+
+    if (!Source || Private->InOffset >= Info->MaxSz) {
+	Info->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+
+    uint16_t Len = Info->MaxSz - Private->InOffset;
+    if (Len > Source->BufSize) Len = Source->BufSize;
+    Len = Source->Read(Source->Ctx, Info->DataOffset + Private->InOffset, Source->Buf, Len);
+    if (!Len) {
+	Info->Error = D_TGIF_ERR_READ;
         return TGIF_ERROR;
     }
+    Private->InPtr = Source->Buf;
+    Private->InEnd = Source->Buf + Len;
+    Private->InOffset += Len;
+    return TGIF_OK;
+}
+
+static int
+TDGifInput(TDGifState *Private, uint8_t *NextByte)
+{
+    if (Private->InPtr == Private->InEnd && TDGifRefill(Private) == TGIF_ERROR)
+        return TGIF_ERROR;
 
-    *NextByte = TDGifReadByte(Private->Info->Data, Private->ReadOffset++);
-    //printf("RB %04X:%02X ", Private->ReadOffset-1, *NextByte);
+    *NextByte = TDGifFetch(Private, Private->InPtr++);
     return TGIF_OK;
 }
 
+/* Add the byte to the CrntShiftState bits already in CrntShiftDWord */
+static inline uint24_t
+TDGifShiftIn(uint24_t CrntShiftDWord, uint8_t CrntShiftState, uint8_t NextByte)
+{
+    uint24_t BigNextByte = NextByte;
+    if (CrntShiftState >= 8) {
+        CrntShiftState -= 8;
+        BigNextByte <<= 8;
+    }
+    return CrntShiftDWord | (BigNextByte << CrntShiftState);
+}
+
 
 /******************************************************************************
  The LZ decompression input routine:
@@ -95,29 +134,67 @@ TDGifInput(TDGifPrivateType *Private, uint8_t *NextByte)
  Returns TGIF_OK if read successfully.
 ******************************************************************************/
 static int
-TDGifDecompressInput(TDGifPrivateType *Private, uint16_t *Code)
+TDGifDecompressInput(TDGifState *Private, uint16_t *Code)
 {
+    uint8_t NextByte;
+    uint8_t CrntShiftState = Private->CrntShiftState;
+#ifdef TDGIF_WIDE_INPUT
+    /* Hosts do variable shifts for free, so fill up CrntShiftDWord with a
+     * single 8 byte load whenever there is that much input left, and only
+     * go byte by byte through the last few. */
+    uint64_t CrntShiftDWord = Private->CrntShiftDWord;
+
+    if (CrntShiftState < Private->RunningBits) {
+        const uint8_t *InPtr = Private->InPtr;
+        if (Private->InEnd - InPtr >= 8) {
+            uint64_t Word;
+            memcpy(&Word, InPtr, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            Word = __builtin_bswap64(Word);
+#endif
+            /* Take as many whole bytes as fit; the bits of the next one
+             * that also got in will just be OR'd in again next time. */
+            CrntShiftDWord |= Word << CrntShiftState;
+            Private->InPtr = InPtr + ((63 - CrntShiftState) >> 3);
+            CrntShiftState |= 56;
+        } else {
+            while (CrntShiftState < Private->RunningBits) {
+                if (TDGifInput(Private, &NextByte) == TGIF_ERROR) {
+                    return TGIF_ERROR;
+                }
+                CrntShiftDWord |= (uint64_t)NextByte << CrntShiftState;
+                CrntShiftState += 8;
+            }
+        }
+    }
+    *Code = CrntShiftDWord & (Private->MaxCode1 - 1);
+    CrntShiftDWord >>= Private->RunningBits;
+    CrntShiftState -= Private->RunningBits;
+#else
     /* Optimization note: AVRs suck at variable shifts, but fixed 8-bit
      * shifts are trivial, thus these optimizations to reduce-by-8
      * if possible */
-
-    uint8_t NextByte;
-    uint8_t CrntShiftState = Private->CrntShiftState;
     uint24_t CrntShiftDWord = Private->CrntShiftDWord;
 
-    while (CrntShiftState < Private->RunningBits) {
-        /* Needs to get more bytes from input stream for next code: */
-        if (TDGifInput(Private, &NextByte) == TGIF_ERROR) {
-            return TGIF_ERROR;
+    if (Private->InEnd - Private->InPtr >= 2) {
+        /* A code never needs more than two new bytes, so if that many are
+         * buffered, there is no need to check for the end of them: */
+        const uint8_t *InPtr = Private->InPtr;
+        while (CrntShiftState < Private->RunningBits) {
+            CrntShiftDWord = TDGifShiftIn(CrntShiftDWord, CrntShiftState,
+                                          TDGifFetch(Private, InPtr++));
+            CrntShiftState += 8;
+        }
+        Private->InPtr = InPtr;
+    } else {
+        while (CrntShiftState < Private->RunningBits) {
+            /* Needs to get more bytes from input stream for next code: */
+            if (TDGifInput(Private, &NextByte) == TGIF_ERROR) {
+                return TGIF_ERROR;
+            }
+            CrntShiftDWord = TDGifShiftIn(CrntShiftDWord, CrntShiftState, NextByte);
+            CrntShiftState += 8;
         }
-        uint24_t BigNextByte = NextByte;
-	uint8_t BigShift = CrntShiftState;
-	if (BigShift >= 8) {
-		BigShift -= 8;
-		BigNextByte <<= 8;
-	}
-        CrntShiftDWord |= BigNextByte << BigShift;
-        CrntShiftState += 8;
     }
     *Code = CrntShiftDWord & (Private->MaxCode1 - 1);
     //printf("Co:%d/%d ", *Code, Private->RunningBits);
@@ -129,6 +206,8 @@ TDGifDecompressInput(TDGifPrivateType *Private, uint16_t *Code)
     CrntShiftDWord >>= BigShift;
     CrntShiftState -= Private->RunningBits;
 
+#endif
+
     Private->CrntShiftDWord = CrntShiftDWord;
     Private->CrntShiftState = CrntShiftState;
 
@@ -147,24 +226,47 @@ TDGifDecompressInput(TDGifPrivateType *Private, uint16_t *Code)
 
 
 
-/******************************************************************************/
-int TDGifGetInfo(const void *TGif, TGifInfo *Info, const uint16_t MaxW, const uint16_t MaxH,
-const uint16_t MaxSz)
+/******************************************************************************
+ What an image without extensions gets. Every parser starts from this, so
+ no field is left to whatever was in the caller's TGifInfo.
+******************************************************************************/
+static void
+TDGifNoExtensions(TGifInfo *Info)
 {
-    if (!Info) return TGIF_ERROR; /* Umm, we want that info slot to give you the info... */
+    Info->Transparent = -1;
+    Info->PresetId = -1;
+    Info->Preset = NULL;
+}
 
-    /* Initial MaxSz check to see if we can even try to parse this. */
-    if (MaxSz < 8) {
-        /* 8: 4 bytes first header, 2 bytes one color, 1 byte code point count header, 1 byte LZW data */
-        Info->Error = D_TGIF_ERR_MAXSZ;
-        return TGIF_ERROR;
-    }
-    uint8_t ExtBits = TDGifReadByte(TGif, 0);
-    Info->Width = TDGifReadByte(TGif, 1);
+/******************************************************************************
+ If Header is an extension rather than the image header, take what it says
+ and return 1.
+******************************************************************************/
+static uint8_t
+TDGifParseExtension(TGifInfo *Info, const uint8_t *Header)
+{
+    if (Header[0] || Header[1])
+        return 0;
+    if (Header[2] == TGIF_EXT_TRANSPARENT)
+        Info->Transparent = Header[3];
+    else if (Header[2] == TGIF_EXT_PRESET)
+        Info->PresetId = Header[3];
+    return 1;
+}
+
+/******************************************************************************
+ Parse the 4 byte header, and work out where the color table and data are.
+******************************************************************************/
+static int
+TDGifParseHeader(TGifInfo *Info, const uint8_t *Header, const uint16_t MaxW,
+const uint16_t MaxH, const uint16_t MaxSz)
+{
+    uint8_t ExtBits = Header[0];
+    Info->Width = Header[1];
     Info->Width |= (ExtBits & 0xC) << 6;
-    Info->Height = TDGifReadByte(TGif, 2);
+    Info->Height = Header[2];
     Info->Height |= (ExtBits & 0x3) << 8;
-    Info->ColorCount = TDGifReadByte(TGif, 3);
+    Info->ColorCount = Header[3];
     if (Info->ColorCount == 0) Info->ColorCount = 256;
     Info->SRAMLimit = (ExtBits & 0xF0) << 4;
     if (Info->SRAMLimit == 0) Info->SRAMLimit = 4096;
@@ -179,10 +281,8 @@ const uint16_t MaxSz)
         return TGIF_ERROR;
     }
 
-    Info->Colors = (const TGifColorType*)( ((const uint8_t*)TGif) + 4);
-
     unsigned int ColorTableSize = sizeof(TGifColorType) * Info->ColorCount;
-    Info->Data = (const uint8_t*)TGif + 4 + ColorTableSize;
+    Info->DataOffset = 4 + ColorTableSize;
 
     /* Second MaxSz check */
     if (MaxSz < (6+ColorTableSize)) {
@@ -197,6 +297,155 @@ const uint16_t MaxSz)
     return TGIF_OK;
 }
 
+/******************************************************************************/
+int TDGifGetInfo(const void *TGif, TGifInfo *Info, const uint16_t MaxW, const uint16_t MaxH,
+const uint16_t MaxSz)
+{
+    if (!Info) return TGIF_ERROR; /* Umm, we want that info slot to give you the info... */
+
+    /* Initial MaxSz check to see if we can even try to parse this. */
+    if (MaxSz < 8) {
+        /* 8: 4 bytes first header, 2 bytes one color, 1 byte code point count header, 1 byte LZW data */
+        Info->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+    uint8_t Header[4];
+    uint16_t Offset = 0;
+    TDGifNoExtensions(Info);
+    for (;;) {
+        if (MaxSz - Offset < 8) {
+            Info->Error = D_TGIF_ERR_MAXSZ;
+            return TGIF_ERROR;
+        }
+        for (uint8_t n = 0; n < 4; n++)
+            Header[n] = TDGifReadByte(TGif, Offset + n);
+        if (!TDGifParseExtension(Info, Header))
+            break;
+        Offset += TGIF_EXT_SIZE;
+    }
+
+    if (TDGifParseHeader(Info, Header, MaxW, MaxH, MaxSz - Offset) == TGIF_ERROR)
+        return TGIF_ERROR;
+    Info->DataOffset += Offset;
+
+    Info->Source = NULL;
+    Info->Workspace = NULL;
+    Info->WorkspaceSize = 0;
+    Info->Colors = (const TGifColorType*)( ((const uint8_t*)TGif) + Offset + 4);
+    Info->Data = (const uint8_t*)TGif + Info->DataOffset;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Same as TDGifGetInfo, for an image only reachable through Source. The
+ color table stays where it is until TDGifLoadColors is asked for it.
+******************************************************************************/
+int TDGifGetInfoSource(const TGifSource *Source, TGifInfo *Info, const uint16_t MaxW,
+const uint16_t MaxH, const uint16_t MaxSz)
+{
+    if (!Info) return TGIF_ERROR;
+
+    if (MaxSz < 8) {
+        Info->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+    uint8_t Header[4];
+    uint16_t Offset = 0;
+    TDGifNoExtensions(Info);
+    for (;;) {
+        if (MaxSz - Offset < 8) {
+            Info->Error = D_TGIF_ERR_MAXSZ;
+            return TGIF_ERROR;
+        }
+        if (Source->Read(Source->Ctx, Offset, Header, 4) != 4) {
+            Info->Error = D_TGIF_ERR_READ;
+            return TGIF_ERROR;
+        }
+        if (!TDGifParseExtension(Info, Header))
+            break;
+        Offset += TGIF_EXT_SIZE;
+    }
+
+    if (TDGifParseHeader(Info, Header, MaxW, MaxH, MaxSz - Offset) == TGIF_ERROR)
+        return TGIF_ERROR;
+    Info->DataOffset += Offset;
+
+    Info->Source = Source;
+    Info->Workspace = NULL;
+    Info->WorkspaceSize = 0;
+    Info->Colors = NULL;
+    Info->Data = NULL;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Read the color table of a TGifSource image into Colors (ColorCount entries)
+ and point Info->Colors at it.
+******************************************************************************/
+int TDGifLoadColors(TGifInfo *Info, TGifColorType *Colors)
+{
+    const TGifSource *Source = Info->Source;
+    uint16_t Len = sizeof(TGifColorType) * Info->ColorCount;
+
+    /* The color table is right in front of the data */
+    if (Source->Read(Source->Ctx, Info->DataOffset - Len, (uint8_t*)Colors, Len) != Len) {
+        Info->Error = D_TGIF_ERR_READ;
+        return TGIF_ERROR;
+    }
+    Info->Colors = Colors;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Use the preset dictionary Preset for this image, if it was encoded with
+ one. It has to be the same one, and fit the image.
+******************************************************************************/
+int TDGifSetPreset(TGifInfo *Info, const uint8_t *Preset, uint16_t Size)
+{
+    if (Info->PresetId < 0)
+        return TGIF_OK;
+    if (!Preset || Size < TGIF_PRESET_HEADER_SIZE ||
+        TDGifReadByte(Preset, 0) != TGIF_PRESET_MAGIC[0] ||
+        TDGifReadByte(Preset, 1) != TGIF_PRESET_MAGIC[1] ||
+        TDGifReadByte(Preset, 2) != Info->PresetId ||
+        TDGifReadByte(Preset, 3) >= Info->ColorCount ||
+        TDGifReadWord(Preset, 4) > TGIF_PRESET_MAX_ENTRIES ||
+        TDGifReadWord(Preset, 6) > TGIF_PRESET_MAX_ENTRIES + 1 ||
+        Size != TGIF_PRESET_HEADER_SIZE + 3 * TDGifReadWord(Preset, 4)) {
+        Info->Error = D_TGIF_ERR_PRESET;
+        return TGIF_ERROR;
+    }
+    Info->Preset = Preset;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Bytes of dictionary memory decoding this image takes: the stack also has
+ to hold the longest preset string on top of the dictionary's.
+******************************************************************************/
+uint16_t TDGifWorkspaceSize(const TGifInfo *Info)
+{
+    if (Info->Preset)
+        return TDGIF_WORKSPACE_SIZE(Info->SRAMLimit) + TDGifReadWord(Info->Preset, 6);
+    return TDGIF_WORKSPACE_SIZE(Info->SRAMLimit);
+}
+
+/******************************************************************************
+ Keep the dictionary in Buf for the decodes of this image, so nothing is
+ allocated (or fragmented) per decode. Buf can be a static buffer of
+ TDGIF_MAX_WORKSPACE bytes shared by every image, one decode at a time.
+******************************************************************************/
+int TDGifSetWorkspace(TGifInfo *Info, uint8_t *Buf, uint16_t Size)
+{
+    if (Buf && Size < TDGifWorkspaceSize(Info)) {
+        Info->Error = D_TGIF_ERR_NOT_ENOUGH_MEM;
+        return TGIF_ERROR;
+    }
+    Info->Workspace = Buf;
+    Info->WorkspaceSize = Size;
+    return TGIF_OK;
+}
+
 
 static uint8_t BitSize(uint16_t n) {
 	uint8_t i;
@@ -208,99 +457,404 @@ static uint8_t BitSize(uint16_t n) {
 	return i;
 }
 
+#ifdef TDGIF_AVX2
 /******************************************************************************
- Routine to trace the Prefixes linked list until we get a prefix which is
- not code, but a pixel value (less than ClearCode). Returns that pixel value.
- If image is defective, we might loop here forever, so we limit the loops to
- the maximum possible if image O.k. - LZ_MAX_CODE times.
+ Gather 8 pixels at a time from Lut, for as many as there are whole groups
+ of 8. Only called if the CPU has AVX2.
 ******************************************************************************/
-static int
-TDGifGetPrefixChar(TDGifPrivateType *Private, unsigned int Code, unsigned int ClearCode)
+__attribute__((target("avx2"))) static uint16_t
+TDGifGatherAVX2(const uint32_t *Lut, const uint8_t *Pixels, uint16_t *Out, uint16_t Len)
+{
+    uint16_t Done = Len & ~7;
+
+    for (uint16_t n = 0; n < Done; n += 8) {
+        __m256i Index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(Pixels + n)));
+        __m256i Color = _mm256_i32gather_epi32((const int*)Lut, Index, 4);
+        _mm_storeu_si128((__m128i*)(Out + n),
+            _mm_packus_epi32(_mm256_castsi256_si128(Color),
+                             _mm256_extracti128_si256(Color, 1)));
+    }
+    return Done;
+}
+#endif
+
+/******************************************************************************
+ Write a run of pixels to the current framebuffer row, starting at column X.
+ On AVR the palette is read straight from flash; elsewhere it was expanded
+ into Lut[] up front, so this is a plain gather (8 at a time with AVX2).
+******************************************************************************/
+static void
+TDGifPutRow(TDGifState *Private, const uint8_t *Pixels, uint16_t Len, uint16_t X)
+{
+    if (Private->Format == TDGIF_FMT_INDEX8) {
+        memcpy(Private->Row + X, Pixels, Len);
+        return;
+    }
+
+    uint16_t *Out = (uint16_t*)(Private->Row) + X;
+#ifdef __AVR
+    const TGifColorType *Colors = Private->Info->Colors;
+    while (Len--) {
+        /* TDGifLoadColors puts the color table in RAM */
+        uint16_t Color = Private->InRam ? Colors[*Pixels] : pgm_read_word(Colors + *Pixels);
+        Pixels++;
+        if (Private->Format == TDGIF_FMT_RGB565_SWAP)
+            Color = (Color << 8) | (Color >> 8);
+        *Out++ = Color;
+    }
+#else
+    const uint32_t *Lut = Private->Lut;
+#ifdef TDGIF_AVX2
+    if (Private->Avx2) {
+        uint16_t Done = TDGifGatherAVX2(Lut, Pixels, Out, Len);
+        Pixels += Done;
+        Out += Done;
+        Len -= Done;
+    }
+#endif
+    while (Len--)
+        *Out++ = Lut[*Pixels++];
+#endif
+}
+
+
+/******************************************************************************
+ Pass on the runs of a row of pixels that are not transparent, skipping the
+ ones that are. X is where the row starts.
+******************************************************************************/
+static void
+TDGifPutOpaque(TDGifState *Private, const uint8_t *Pixels, uint16_t Len, uint16_t X)
+{
+    int Transparent = Private->Info->Transparent;
+    uint16_t Y = Private->Y - Private->ClipY, n = 0;
+
+    if (Private->Scale > 1)
+        Y /= Private->Scale;
+
+    while (n < Len) {
+        while (n < Len && Pixels[n] == Transparent)
+            n++;
+        uint16_t Start = n;
+        while (n < Len && Pixels[n] != Transparent)
+            n++;
+        if (n > Start)
+            Private->OpaqueCB(X + Start, Y, Pixels + Start, n - Start);
+    }
+}
+
+
+/******************************************************************************
+ Hand pixels to whichever sink the caller asked for. X is the column within
+ the clip rectangle, for the framebuffer.
+******************************************************************************/
+static void
+TDGifDeliver(TDGifState *Private, const uint8_t *Pixels, uint16_t Len, uint16_t X)
+{
+    if (Private->Row) {
+        TDGifPutRow(Private, Pixels, Len, X);
+    } else if (Private->OpaqueCB) {
+        TDGifPutOpaque(Private, Pixels, Len, X);
+    } else if (Private->SpanCB) {
+        Private->SpanCB(Pixels, Len);
+    } else if (Private->PixelCB) {
+        while (Len--)
+            Private->PixelCB(*Pixels++);
+    }
+}
+
+
+/******************************************************************************
+ RGB565 color Color spread out to 0000 0GGG GGG0 0000 RRRR R000 000B BBBB,
+ which leaves room to add up 32 of them.
+******************************************************************************/
+#define TDGIF_SPREAD(Color) (((uint32_t)(Color) | (uint32_t)(Color) << 16) & 0x07E0F81F)
+
+/******************************************************************************
+ Scale down a run of pixels from one row of the clip rectangle, X the
+ column there. Nearest passes on every Scale-th pixel of every Scale-th row
+ as it is; Box adds all of them to the sums of their output column.
+******************************************************************************/
+static void
+TDGifScaleRun(TDGifState *Private, const uint8_t *Pixels, uint16_t Len, uint16_t X)
 {
-    int i = 0;
+    uint8_t Scale = Private->Scale;
+    uint8_t Sub = X % Scale;
+
+    if (Private->Sums) {
+        uint32_t *Sum = Private->Sums + X / Scale;
+        while (Len--) {
+#ifdef __AVR
+            const TGifColorType *Colors = Private->Info->Colors;
+            uint16_t Color = Private->InRam ? Colors[*Pixels] : pgm_read_word(Colors + *Pixels);
+            *Sum += TDGIF_SPREAD(Color);
+#else
+            *Sum += Private->Lut[*Pixels];    /* Spread by TDGifSetScale */
+#endif
+            Pixels++;
+            if (++Sub == Scale) {
+                Sub = 0;
+                Sum++;
+            }
+        }
+        return;
+    }
 
-    while (Code > ClearCode && i++ <= LZ_MAX_CODE) {
-        if (Code > Private->MaxCodePoint) {
-            return NO_SUCH_CODE;
+    if (Private->SubY)
+        return;
+    uint8_t Kept[32], n = 0;
+    uint16_t i = Sub ? Scale - Sub : 0;
+    X = (X + i) / Scale;
+    for (; i < Len; i += Scale) {
+        Kept[n++] = Pixels[i];
+        if (n == sizeof(Kept)) {
+            TDGifDeliver(Private, Kept, n, X);
+            X += n;
+            n = 0;
         }
-        Code = Private->Prefix[Code - Private->DictBase];
     }
-    return Code;
+    if (n)
+        TDGifDeliver(Private, Kept, n, X);
 }
 
+/******************************************************************************
+ A row of the clip rectangle is done (Y is already past it). Returns 1 if
+ that completes a row of scaled output, after writing out the averages of
+ a box filter.
+******************************************************************************/
+static uint8_t
+TDGifScaleRowEnd(TDGifState *Private)
+{
+    uint8_t Scale = Private->Scale;
+
+    if (++Private->SubY < Scale && Private->Y - Private->ClipY < Private->ClipH)
+        return 0;
 
+    if (Private->Sums) {
+        uint16_t Width = TDGIF_SCALED(Private->ClipW, Scale);
+        uint16_t *Out = (uint16_t*)Private->Row;
+        uint8_t Across = Scale;
+        for (uint16_t n = 0; n < Width; n++) {
+            uint32_t Sum = Private->Sums[n];
+            if (n == Width - 1)
+                Across = Private->ClipW - n * Scale;    /* Cut off by the edge */
+            uint8_t Count = Across * Private->SubY, Half = Count / 2;
+            uint16_t Color = (((Sum >> 11 & 0x3FF) + Half) / Count) << 11 |
+                             (((Sum >> 21) + Half) / Count) << 5 |
+                             ((Sum & 0x7FF) + Half) / Count;
+            if (Private->Format == TDGIF_FMT_RGB565_SWAP)
+                Color = (Color << 8) | (Color >> 8);
+            Out[n] = Color;
+            Private->Sums[n] = 0;
+        }
+    }
+    Private->SubY = 0;
+    return 1;
+}
 
 
 /******************************************************************************
- The LZ decompression routine:
- This version decompress the given GIF file into Line of length LineLen.
- This routine can be called few times (one per scan line, for example), in
- order the complete the whole image.
+ Output a decoded run of pixels. Unless the output cares about where the
+ pixels are (a framebuffer, or a clip rectangle), it goes out as is.
 ******************************************************************************/
-int
-TDGifDecompress(TGifInfo *Info, void(*OutputCB)(uint8_t) )
+static void
+TDGifOutput(TDGifState *Private, const uint8_t *Pixels, uint16_t Len)
 {
+    if (!Private->Positioned) {
+        TDGifDeliver(Private, Pixels, Len, 0);
+        return;
+    }
 
-    TDGifPrivateType PrivateStuff;
-    TDGifPrivateType *Private = &PrivateStuff;
+    /* Split the run at row ends, and pass on what is inside the clip. */
+    uint16_t Width = Private->Info->Width;
+    while (Len) {
+        uint16_t n = Width - Private->X;
+        if (n > Len) n = Len;
+        uint8_t Inside = (uint16_t)(Private->Y - Private->ClipY) < Private->ClipH;
+        if (Inside) {
+            uint16_t From = Private->X, To = Private->X + n;
+            if (From < Private->ClipX) From = Private->ClipX;
+            if (To > Private->ClipX + Private->ClipW) To = Private->ClipX + Private->ClipW;
+            if (From < To && Private->Scale > 1)
+                TDGifScaleRun(Private, Pixels + (From - Private->X), To - From,
+                              From - Private->ClipX);
+            else if (From < To)
+                TDGifDeliver(Private, Pixels + (From - Private->X), To - From,
+                             From - Private->ClipX);
+        }
+        Pixels += n;
+        Len -= n;
+        Private->X += n;
+        if (Private->X == Width) {
+            Private->X = 0;
+            Private->Y++;
+            if (Inside && Private->Scale > 1 && !TDGifScaleRowEnd(Private))
+                continue;
+            if (Inside && Private->Row)
+                Private->Row += Private->Stride;
+        }
+    }
+}
 
-    int CodeCount = TDGifReadByte(Info->Data, 0);
-    if (CodeCount == 0) CodeCount = 256;
 
-    Private->ReadOffset = 1;
+/******************************************************************************
+ Work out the dictionary geometry and reset the LZ state for a new image.
+ Only the code count byte is read, no memory is allocated yet, so DictSize
+ can be used to size the allocation.
+******************************************************************************/
+static int
+TDGifInit(TDGifState *Private, TGifInfo *Info)
+{
     Private->Info = Info;
-    Private->DictBase = CodeCount + 1;
+    Private->InRam = Info->Source != NULL;
+    if (Info->Source) {
+        Private->InPtr = Private->InEnd = NULL;    /* First read refills */
+        Private->InOffset = 0;
+    } else {
+        Private->InPtr = Info->Data;
+        Private->InEnd = Private->InPtr + Info->MaxSz;
+        Private->InOffset = Info->MaxSz;
+    }
+
+    uint8_t Byte;
+    if (TDGifInput(Private, &Byte) == TGIF_ERROR)
+        return TGIF_ERROR;
+    int CodeCount = Byte;
+    if (CodeCount == 0) CodeCount = 256;
+
+    /* Preset entries come right after the clear code, then our own */
+    uint16_t PresetCount = 0, PresetMaxLen = 0;
+    Private->Preset = NULL;
+    if (Info->PresetId >= 0) {
+        if (!Info->Preset) {
+            Info->Error = D_TGIF_ERR_PRESET;
+            return TGIF_ERROR;
+        }
+        Private->Preset = Info->Preset;
+        PresetCount = TDGifReadWord(Info->Preset, 4);
+        PresetMaxLen = TDGifReadWord(Info->Preset, 6);
+        if (CodeCount + 1 + PresetCount >= LZ_MAX_CODE) {
+            Info->Error = D_TGIF_ERR_PRESET;
+            return TGIF_ERROR;
+        }
+    }
+
+    Private->DictBase = CodeCount + 1 + PresetCount;
     Private->DictSize = Info->SRAMLimit/4;
     if ((Private->DictSize+Private->DictBase) > (LZ_MAX_CODE+1)) {
 	Private->DictSize = (LZ_MAX_CODE+1) - Private->DictBase;
     }
+    Private->StackSize = Private->DictSize + PresetMaxLen;
     Private->MaxCodePoint = Private->DictBase + (Private->DictSize-1); /* Maximum code actually used */
     Private->MaxCodeBits = BitSize(Private->MaxCodePoint);
 
     //printf("CodeCount %d ", CodeCount);
     Private->ClearCode = CodeCount;
-    Private->RunningCode = CodeCount + 1;
+    Private->RunningCode = Private->DictBase;
     Private->InitCodeBits = BitSize(Private->RunningCode);
     Private->RunningBits = Private->InitCodeBits;    /* Number of bits per code. */
     Private->MaxCode1 = 1 << Private->RunningBits;    /* Max. code + 1. */
     Private->CrntShiftState = 0;    /* No information in CrntShiftDWord. */
     Private->CrntShiftDWord = 0;
 
-    uint8_t *Alloc = ALLOC(Private->DictSize * 4);
-    if (!Alloc) {
-	Info->Error = D_TGIF_ERR_NOT_ENOUGH_MEM;
-	return TGIF_ERROR;
-    }
-    uint16_t *Prefix = (uint16_t*)Alloc;
-    uint8_t *Suffix = Alloc + (Private->DictSize * 2);
-    uint8_t *Stack = Alloc + (Private->DictSize * 3);
+    Private->LastCode = NO_SUCH_CODE;
+    Private->Pixel = 0;
+    Private->PixelCount = (uint24_t)Info->Width * Info->Height;
+
+    /* No output until the caller picks one. */
+    Private->PixelCB = NULL;
+    Private->SpanCB = NULL;
+    Private->OpaqueCB = NULL;
+    Private->Row = NULL;
+    Private->Alloc = NULL;
+    Private->Positioned = 0;
+    Private->Scale = 1;
+    Private->SubY = 0;
+    Private->Sums = NULL;
+    Private->X = Private->Y = 0;
+    Private->ClipX = Private->ClipY = 0;
+    Private->ClipW = Info->Width;
+    Private->ClipH = Info->Height;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Empty the dictionary, as on a clear code. Entries are defined strictly in
+ order, so everything from NextCode up is unused and there is nothing else
+ to clear - whatever was left in Prefix[]/Suffix[] is never looked at.
+******************************************************************************/
+static void
+TDGifResetDict(TDGifState *Private)
+{
+    Private->NextCode = Private->DictBase;
+    Private->RunningCode = Private->DictBase;
+    Private->RunningBits = Private->InitCodeBits;
+    Private->MaxCode1 = 1 << Private->RunningBits;
+}
 
-    Private->Prefix = Prefix;
+/******************************************************************************
+ Carve the DictSize * 3 + StackSize bytes at Alloc up into the dictionary
+ and stack.
+******************************************************************************/
+static void
+TDGifStart(TDGifState *Private, uint8_t *Alloc)
+{
+    Private->Prefix = (uint16_t*)Alloc;
+    Private->Suffix = Alloc + (Private->DictSize * 2);
+    Private->Stack = Alloc + (Private->DictSize * 3);
+    Private->StackPtr = Private->StackSize;    /* Nothing waiting for output. */
 
-    for (uint16_t i = 0; i < Private->DictSize; i++)
-        Prefix[i] = NO_SUCH_CODE;
+    TDGifResetDict(Private);
+}
 
-    uint16_t LastCode = NO_SUCH_CODE;
-    uint16_t StackPtr = 0;
+/******************************************************************************
+ The LZ decompression routine:
+ This version decompresses up to MaxPixels pixels of the image and then
+ returns, so it can be called repeatedly to decode the image in slices.
+ Every decoded string is built back-to-front at the top of Stack[], so it
+ comes out in order, and whatever part of it did not fit in this slice is
+ still there for the next call to pick up.
+ Returns TGIF_OK when the image is complete, TDGIF_MORE if it is not yet.
+******************************************************************************/
+static int
+TDGifRun(TDGifState *Private, uint24_t MaxPixels)
+{
+    TGifInfo *Info = Private->Info;
+    uint16_t *Prefix = Private->Prefix;
+    uint8_t *Suffix = Private->Suffix;
+    uint8_t *Stack = Private->Stack;
+    uint16_t LastCode = Private->LastCode;
+    uint16_t StackPtr = Private->StackPtr;
     uint16_t ClearCode = Private->ClearCode;
-    uint16_t CrntPrefix, CrntCode;
+    uint16_t CrntPrefix, CrntCode, Len, Entry;
+    uint16_t PresetCount = Private->DictBase - ClearCode - 1;
+    const uint8_t *Preset = Private->Preset;
+    uint8_t First;
 
-    uint24_t i = 0;
-    uint24_t PixelCount = (uint24_t)Info->Width * Info->Height;
+    uint24_t i = Private->Pixel;
+    uint24_t End = Private->PixelCount;
+    if (MaxPixels < End - i)
+        End = i + MaxPixels;
+
+    while (i < End) {    /* Decode this slice.. */
+        if (StackPtr < Private->StackSize) {
+            /* Output (what fits of) the string waiting on the stack. */
+            Len = Private->StackSize - StackPtr;
+            if (Len > End - i)
+                Len = End - i;
+            TDGifOutput(Private, Stack + StackPtr, Len);
+            StackPtr += Len;
+            i += Len;
+            continue;
+        }
 
-    while (i < PixelCount) {    /* Decode all.. */
         if (TDGifDecompressInput(Private, &CrntCode) == TGIF_ERROR) {
-            FREE(Alloc);
+            Private->Pixel = i;
             return TGIF_ERROR;
         }
 
         if (CrntCode == ClearCode) {
             /* We need to start over again: */
-            for (uint16_t j = 0; j < Private->DictSize; j++)
-                Prefix[j] = NO_SUCH_CODE;
-            Private->RunningCode = CodeCount + 1;
-            Private->RunningBits = Private->InitCodeBits;
-            Private->MaxCode1 = 1 << Private->RunningBits;
+            TDGifResetDict(Private);
             LastCode = NO_SUCH_CODE;
             continue;
         }
@@ -311,31 +865,26 @@ TDGifDecompress(TGifInfo *Info, void(*OutputCB)(uint8_t) )
         if (CrntCode < ClearCode) {
 	    //printf("S %d<%d ", CrntCode, ClearCode);
             /* This is simple - its pixel scalar, so add it to output. */
-            OutputCB(CrntCode);
-            i++;
+            First = CrntCode;
+            Stack[--StackPtr] = CrntCode;
         } else {
             /* Its a code to needed to be traced: trace the linked list
              * until the prefix is a pixel, while pushing the suffix
-             * pixels on our stack. If we done, pop the stack in reverse
-             * (thats what stack is good for!) order to output.  */
-            if (Prefix[CrntCode - Private->DictBase] == NO_SUCH_CODE) {
-                CrntPrefix = LastCode;
-
+             * pixels downwards from the top of the stack. When done, the
+             * string sits in order at Stack[StackPtr..StackSize). */
+            if (CrntCode >= Private->NextCode) {
                 /* Only allowed if CrntCode is exactly the running code:
                  * In that case CrntCode = XXXCode, CrntCode or the
                  * prefix code is last code and the suffix char is
-                 * exactly the prefix of last code! */
-                if (CrntCode == Private->RunningCode - 2) {
-                    Suffix[(Private->RunningCode - 2) - Private->DictBase] =
-                       Stack[StackPtr++] = TDGifGetPrefixChar(Private,
-                                                             LastCode,
-                                                             ClearCode);
-                } else {
-                    Suffix[(Private->RunningCode - 2) - Private->DictBase] =
-                       Stack[StackPtr++] = TDGifGetPrefixChar(Private,
-                                                             CrntCode,
-                                                             ClearCode);
+                 * exactly the first char of last code! */
+                if (CrntCode != Private->NextCode || CrntCode > Private->MaxCodePoint ||
+                    LastCode == NO_SUCH_CODE) {
+                    Info->Error = D_TGIF_ERR_IMAGE_DEFECT;
+                    Private->Pixel = i;
+                    return TGIF_ERROR;
                 }
+                CrntPrefix = LastCode;
+                Stack[--StackPtr] = Private->LastFirst;
             } else {
                 CrntPrefix = CrntCode;
             }
@@ -344,52 +893,786 @@ TDGifDecompress(TGifInfo *Info, void(*OutputCB)(uint8_t) )
             /* Now (if image is O.K.) we should not get a NO_SUCH_CODE
              * during the trace. As we might loop forever, in case of
              * defective image, we use StackPtr as loop counter and stop
-             * before overflowing Stack[]. */
-            while (StackPtr < Private->DictSize &&
-                     CrntPrefix > ClearCode && CrntPrefix <= Private->MaxCodePoint) {
-                Stack[StackPtr++] = Suffix[CrntPrefix - Private->DictBase];
+             * before running off the bottom of Stack[]. */
+            while (StackPtr > 0 &&
+                     CrntPrefix >= Private->DictBase && CrntPrefix <= Private->MaxCodePoint) {
+                Stack[--StackPtr] = Suffix[CrntPrefix - Private->DictBase];
                 CrntPrefix = Prefix[CrntPrefix - Private->DictBase];
             }
-            if (StackPtr >= Private->DictSize || CrntPrefix > Private->MaxCodePoint) {
+            /* The chain may end in a preset entry, which only lead to
+             * each other and to pixels. */
+            while (StackPtr > 0 &&
+                     CrntPrefix > ClearCode && CrntPrefix < Private->DictBase) {
+                Entry = CrntPrefix - ClearCode - 1;
+                Stack[--StackPtr] = TDGifReadByte(Preset, TGIF_PRESET_HEADER_SIZE +
+                                                  2 * PresetCount + Entry);
+                CrntPrefix = TDGifReadWord(Preset, TGIF_PRESET_HEADER_SIZE + 2 * Entry);
+                if (CrntPrefix >= 256)
+                    CrntPrefix += ClearCode + 1 - 256;
+            }
+            if (CrntPrefix >= ClearCode) {
 		//printf("StackPtr %d CrntPrefix %d ", StackPtr, CrntPrefix);
                 Info->Error = D_TGIF_ERR_IMAGE_DEFECT;
-                FREE(Alloc);
+                Private->Pixel = i;
                 return TGIF_ERROR;
             }
 
-            /* Output the last character (since it'd be first out the stack). */
-            //Stack[StackPtr++] = CrntPrefix;
-            OutputCB(CrntPrefix);
-            i++;
-
-            /* Now lets pop all the stack into output: */
-            while (StackPtr != 0 && i < PixelCount) {
-                OutputCB(Stack[--StackPtr]);
+            /* The last character traced is the first one of the string.
+             * A chain through the whole dictionary (one long run, say) is
+             * one longer than the stack: its first pixel goes out now. */
+            First = CrntPrefix;
+            if (StackPtr == 0) {
+                TDGifOutput(Private, &First, 1);
                 i++;
-            }
-        }
-        if (LastCode != NO_SUCH_CODE && Prefix[(Private->RunningCode - 2) - Private->DictBase] == NO_SUCH_CODE) {
-            Prefix[(Private->RunningCode - 2) - Private->DictBase] = LastCode;
-
-            if (CrntCode == Private->RunningCode - 2) {
-                /* Only allowed if CrntCode is exactly the running code:
-                 * In that case CrntCode = XXXCode, CrntCode or the
-                 * prefix code is last code and the suffix char is
-                 * exactly the prefix of last code! */
-                Suffix[(Private->RunningCode - 2) - Private->DictBase] =
-                   TDGifGetPrefixChar(Private, LastCode, ClearCode);
             } else {
-                Suffix[(Private->RunningCode - 2) - Private->DictBase] =
-                   TDGifGetPrefixChar(Private, CrntCode, ClearCode);
+                Stack[--StackPtr] = CrntPrefix;
             }
         }
+        /* The new entry is last code plus the first char of this string,
+         * which the trace just found - no need to walk the prefix chain
+         * again for it. */
+        if (LastCode != NO_SUCH_CODE && Private->NextCode <= Private->MaxCodePoint) {
+            Prefix[Private->NextCode - Private->DictBase] = LastCode;
+            Suffix[Private->NextCode - Private->DictBase] = First;
+            Private->NextCode++;
+        }
+        Private->LastFirst = First;
         LastCode = CrntCode;
     }
 
+    /* Preserve the state for the next slice: */
+    Private->LastCode = LastCode;
+    Private->StackPtr = StackPtr;
+    Private->Pixel = i;
+
+    return i < Private->PixelCount ? TDGIF_MORE : TGIF_OK;
+}
+
+/******************************************************************************
+ The caller's workspace, if it has set one, or NULL. Too small is an error.
+******************************************************************************/
+static int
+TDGifWorkspace(TDGifState *Private, uint8_t **Workspace)
+{
+    TGifInfo *Info = Private->Info;
+
+    *Workspace = Info->Workspace;
+    if (Info->Workspace && Info->WorkspaceSize < Private->DictSize * 3 + Private->StackSize) {
+	Info->Error = D_TGIF_ERR_NOT_ENOUGH_MEM;
+	return TGIF_ERROR;
+    }
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Decode the rest of an image in one go, with the dictionary in the workspace
+ or on ALLOC().
+******************************************************************************/
+static int
+TDGifDecode(TDGifState *Private)
+{
+    uint8_t *Workspace;
+    if (TDGifWorkspace(Private, &Workspace) == TGIF_ERROR)
+	return TGIF_ERROR;
+    if (Workspace) {
+	TDGifStart(Private, Workspace);
+	return TDGifRun(Private, Private->PixelCount);
+    }
+
+    uint8_t *Alloc = ALLOC(Private->DictSize * 3 + Private->StackSize);
+    if (!Alloc) {
+	Private->Info->Error = D_TGIF_ERR_NOT_ENOUGH_MEM;
+	return TGIF_ERROR;
+    }
+    TDGifStart(Private, Alloc);
+
+    int Result = TDGifRun(Private, Private->PixelCount);
+
     FREE(Alloc);
+    return Result;
+}
+
+
+/******************************************************************************
+ Decode the whole image, one OutputCB call per pixel.
+******************************************************************************/
+int
+TDGifDecompress(TGifInfo *Info, void(*OutputCB)(uint8_t) )
+{
+    TDGifState Private;
+
+    if (TDGifInit(&Private, Info) == TGIF_ERROR)
+        return TGIF_ERROR;
+    TDGifSetPixelOutput(&Private, OutputCB);
+    return TDGifDecode(&Private);
+}
+
+
+/******************************************************************************
+ Decode the whole image, one SpanCB call per decoded string. The pixels
+ handed over are only valid for the duration of the call.
+******************************************************************************/
+int
+TDGifDecompressSpans(TGifInfo *Info, void(*SpanCB)(const uint8_t *, uint16_t) )
+{
+    TDGifState Private;
+
+    if (TDGifInit(&Private, Info) == TGIF_ERROR)
+        return TGIF_ERROR;
+    TDGifSetSpanOutput(&Private, SpanCB);
+    return TDGifDecode(&Private);
+}
+
+
+/******************************************************************************
+ Decode the whole image, one OpaqueCB call per run of pixels within a row
+ that are not the transparent color (or per piece of one, where it spans
+ decoded strings). Nothing at all is said about the transparent ones, so a
+ sprite can go straight to a display without touching the background.
+******************************************************************************/
+int
+TDGifDecompressOpaque(TGifInfo *Info,
+                      void(*OpaqueCB)(uint16_t X, uint16_t Y, const uint8_t *, uint16_t) )
+{
+    TDGifState Private;
+
+    if (TDGifInit(&Private, Info) == TGIF_ERROR)
+        return TGIF_ERROR;
+    TDGifSetOpaqueOutput(&Private, OpaqueCB);
+    return TDGifDecode(&Private);
+}
+
+
+/******************************************************************************
+ Decode the whole image straight into a framebuffer, Stride bytes per row,
+ either as palette indexes or expanded to (optionally byte-swapped) RGB565.
+******************************************************************************/
+int
+TDGifDecompressToBuffer(TGifInfo *Info, void *Buf, uint16_t Stride, uint8_t Format)
+{
+    TDGifState Private;
+
+    if (TDGifInit(&Private, Info) == TGIF_ERROR)
+        return TGIF_ERROR;
+    if (TDGifSetBufferOutput(&Private, Buf, Stride, Format) == TGIF_ERROR)
+        return TGIF_ERROR;
+    return TDGifDecode(&Private);
+}
+
+
+/******************************************************************************
+ Output selection for TDGifBegin/TDGifStep. With none selected, TDGifStep
+ still decodes but throws the pixels away.
+******************************************************************************/
+void
+TDGifSetPixelOutput(TDGifState *State, void(*OutputCB)(uint8_t) )
+{
+    State->PixelCB = OutputCB;
+    State->SpanCB = NULL;
+    State->OpaqueCB = NULL;
+    State->Row = NULL;
+    State->Positioned = State->ClipW != State->Info->Width || State->ClipH != State->Info->Height;
+}
+
+void
+TDGifSetSpanOutput(TDGifState *State, void(*SpanCB)(const uint8_t *, uint16_t) )
+{
+    State->PixelCB = NULL;
+    State->SpanCB = SpanCB;
+    State->OpaqueCB = NULL;
+    State->Row = NULL;
+    State->Positioned = State->ClipW != State->Info->Width || State->ClipH != State->Info->Height;
+}
+
+/* X, Y are where the run starts in the clip rectangle (the image, unless
+ * TDGifSetRect says otherwise), and it never goes past the end of the row. */
+void
+TDGifSetOpaqueOutput(TDGifState *State,
+                     void(*OpaqueCB)(uint16_t X, uint16_t Y, const uint8_t *, uint16_t) )
+{
+    State->PixelCB = NULL;
+    State->SpanCB = NULL;
+    State->OpaqueCB = OpaqueCB;
+    State->Row = NULL;
+    State->Positioned = 1;
+}
+
+int
+TDGifSetBufferOutput(TDGifState *State, void *Buf, uint16_t Stride, uint8_t Format)
+{
+    if (Format > TDGIF_FMT_RGB565_SWAP ||
+        (Format != TDGIF_FMT_INDEX8 && (!State->Info->Colors || (Stride & 1)))) {
+        State->Info->Error = D_TGIF_ERR_BAD_FORMAT;
+        return TGIF_ERROR;
+    }
+
+    State->PixelCB = NULL;
+    State->SpanCB = NULL;
+    State->OpaqueCB = NULL;
+    State->Row = Buf;
+    State->Positioned = 1;
+    State->Stride = Stride;
+    State->Format = Format;
+#ifndef __AVR
+    for (int n = 0; Format != TDGIF_FMT_INDEX8 && n < 256; n++) {
+        uint16_t Color = n < State->Info->ColorCount ? State->Info->Colors[n] : 0;
+        if (Format == TDGIF_FMT_RGB565_SWAP)
+            Color = (Color << 8) | (Color >> 8);
+        State->Lut[n] = Color;
+    }
+#ifdef TDGIF_AVX2
+    State->Avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+#endif
+    return TGIF_OK;
+}
+
+
+/******************************************************************************
+ Only output the W x H rectangle at X,Y (a framebuffer output then holds
+ just that). Decoding starts at the last of the NumPoints restart Points
+ at or above row Y, rather than at the top of the image, and stops at the
+ end of the rectangle. Must come before the first TDGifStep.
+******************************************************************************/
+int
+TDGifSetRect(TDGifState *State, const TGifRestartPoint *Points, uint16_t NumPoints,
+             uint16_t X, uint16_t Y, uint16_t W, uint16_t H)
+{
+    TGifInfo *Info = State->Info;
+
+    if (!W || !H || X + W > Info->Width || Y + H > Info->Height) {
+        Info->Error = D_TGIF_ERR_BAD_RECT;
+        return TGIF_ERROR;
+    }
+    State->ClipX = X;
+    State->ClipY = Y;
+    State->ClipW = W;
+    State->ClipH = H;
+    State->Positioned = 1;
+    State->PixelCount = (uint24_t)(Y + H - 1) * Info->Width + X + W;
+
+    /* Find the restart point: Points are in row order. */
+    uint16_t Lo = 0, Hi = NumPoints, Offset = 1, Row = 0;
+    uint8_t Bit = 0;
+    while (Lo < Hi) {
+        uint16_t Mid = (Lo + Hi) / 2;
+        if (TGIF_RP_ROW(pgm_read_word(&Points[Mid].RowBit)) <= Y)
+            Lo = Mid + 1;
+        else
+            Hi = Mid;
+    }
+    if (Lo) {
+        uint16_t RowBit = pgm_read_word(&Points[Lo - 1].RowBit);
+        Offset = pgm_read_word(&Points[Lo - 1].Offset);
+        Row = TGIF_RP_ROW(RowBit);
+        Bit = TGIF_RP_BIT(RowBit);
+    }
+
+    /* The dictionary is still empty, so just move the input there. */
+    if (Offset >= Info->MaxSz) {
+        Info->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+    if (Info->Source) {
+        State->InPtr = State->InEnd = NULL;
+        State->InOffset = Offset;
+    } else {
+        State->InPtr = (const uint8_t*)Info->Data + Offset;
+    }
+    State->CrntShiftDWord = 0;
+    State->CrntShiftState = 0;
+    if (Bit) {
+        uint8_t Byte;
+        if (TDGifInput(State, &Byte) == TGIF_ERROR)
+            return TGIF_ERROR;
+        State->CrntShiftDWord = Byte >> Bit;
+        State->CrntShiftState = 8 - Bit;
+    }
+    State->Pixel = (uint24_t)Row * Info->Width;
+    State->X = 0;
+    State->Y = Row;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Decode just the W x H rectangle at X,Y into a framebuffer, starting from
+ the nearest restart point, if any.
+******************************************************************************/
+int
+TDGifDecompressRect(TGifInfo *Info, const TGifRestartPoint *Points, uint16_t NumPoints,
+                    uint16_t X, uint16_t Y, uint16_t W, uint16_t H,
+                    void *Buf, uint16_t Stride, uint8_t Format)
+{
+    TDGifState Private;
+
+    if (TDGifInit(&Private, Info) == TGIF_ERROR ||
+        TDGifSetBufferOutput(&Private, Buf, Stride, Format) == TGIF_ERROR ||
+        TDGifSetRect(&Private, Points, NumPoints, X, Y, W, H) == TGIF_ERROR)
+        return TGIF_ERROR;
+    return TDGifDecode(&Private);
+}
+
+
+/******************************************************************************
+ Scale the output down by Scale: see tdgif_lib.h. Nearest works with any
+ output, and the rows it does not pass on never get past TDGifOutput; Box
+ needs an RGB565 framebuffer to average into. Must come after the output
+ is picked (and after TDGifSetRect, if any), before the first TDGifStep.
+******************************************************************************/
+int
+TDGifSetScale(TDGifState *State, uint8_t Scale, uint8_t Filter, uint32_t *Sums)
+{
+    if (!Scale || Filter > TDGIF_SCALE_BOX ||
+        (Filter == TDGIF_SCALE_BOX && Scale > 1 &&
+         (Scale > TDGIF_MAX_BOX_SCALE || !Sums || !State->Row || State->Format == TDGIF_FMT_INDEX8))) {
+        State->Info->Error = D_TGIF_ERR_BAD_SCALE;
+        return TGIF_ERROR;
+    }
+
+    State->Scale = Scale;
+    State->SubY = 0;
+    State->Sums = NULL;
+    if (Scale == 1)
+        return TGIF_OK;
+    State->Positioned = 1;
+    if (Filter == TDGIF_SCALE_BOX) {
+        State->Sums = Sums;
+        memset(Sums, 0, TDGIF_SCALED(State->ClipW, Scale) * sizeof(uint32_t));
+        /* The sums go out at the end of a row, so decode to the end of the last */
+        State->PixelCount = (uint24_t)(State->ClipY + State->ClipH) * State->Info->Width;
+#ifndef __AVR
+        /* Sum colors straight from the Lut, whatever the byte order */
+        for (int n = 0; n < 256; n++)
+            State->Lut[n] = n < State->Info->ColorCount ? TDGIF_SPREAD(State->Info->Colors[n]) : 0;
+#endif
+    }
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Decode the image scaled down into a framebuffer. Nearest only needs every
+ Scale-th row, so with restart points it decodes strip by strip, from the
+ first row it needs to the last, and skips the strips without one. The box
+ filter needs all of them, and sums for a row of output.
+******************************************************************************/
+int
+TDGifDecompressScaled(TGifInfo *Info, const TGifRestartPoint *Points, uint16_t NumPoints,
+                      uint8_t Scale, uint8_t Filter, void *Buf, uint16_t Stride, uint8_t Format)
+{
+    TDGifState Private;
+    uint32_t *Sums = NULL;
+    int Result;
+
+    if (!Scale || Filter > TDGIF_SCALE_BOX ||
+        (Filter == TDGIF_SCALE_BOX && Scale > TDGIF_MAX_BOX_SCALE)) {
+        Info->Error = D_TGIF_ERR_BAD_SCALE;
+        return TGIF_ERROR;
+    }
+
+    if (Filter == TDGIF_SCALE_NEAREST && NumPoints) {
+        for (uint16_t Strip = 0; Strip <= NumPoints; Strip++) {
+            uint16_t First = 0, Last = Info->Height;
+            if (Strip > 0)
+                First = TGIF_RP_ROW(pgm_read_word(&Points[Strip - 1].RowBit));
+            if (Strip < NumPoints)
+                Last = TGIF_RP_ROW(pgm_read_word(&Points[Strip].RowBit));
+            uint16_t Y = (First + Scale - 1) / Scale * Scale;
+            if (Y >= Last)
+                continue;
+            if (TDGifInit(&Private, Info) == TGIF_ERROR ||
+                TDGifSetBufferOutput(&Private, (uint8_t*)Buf + (uint32_t)(Y / Scale) * Stride,
+                                     Stride, Format) == TGIF_ERROR ||
+                TDGifSetRect(&Private, Points, NumPoints, 0, Y, Info->Width,
+                             (Last - 1 - Y) / Scale * Scale + 1) == TGIF_ERROR ||
+                TDGifSetScale(&Private, Scale, Filter, NULL) == TGIF_ERROR ||
+                TDGifDecode(&Private) == TGIF_ERROR)
+                return TGIF_ERROR;
+        }
+        return TGIF_OK;
+    }
+
+    if (TDGifInit(&Private, Info) == TGIF_ERROR ||
+        TDGifSetBufferOutput(&Private, Buf, Stride, Format) == TGIF_ERROR)
+        return TGIF_ERROR;
+    if (Filter == TDGIF_SCALE_BOX && Scale > 1) {
+        Sums = ALLOC(TDGIF_SCALED(Info->Width, Scale) * sizeof(uint32_t));
+        if (!Sums) {
+            Info->Error = D_TGIF_ERR_NOT_ENOUGH_MEM;
+            return TGIF_ERROR;
+        }
+    }
+    Result = TDGifSetScale(&Private, Scale, Filter, Sums);
+    if (Result != TGIF_ERROR)
+        Result = TDGifDecode(&Private);
+    FREE(Sums);
+    return Result;
+}
+
+
+/******************************************************************************
+ Decode strip number Strip into a framebuffer of the whole image. The strips
+ are the rows between consecutive restart points, so there are NumPoints+1
+ of them, and each one can be decoded on its own (on its own core, say).
+******************************************************************************/
+int
+TDGifDecompressStrip(TGifInfo *Info, const TGifRestartPoint *Points, uint16_t NumPoints,
+                     uint16_t Strip, void *Buf, uint16_t Stride, uint8_t Format)
+{
+    uint16_t First = 0, Last = Info->Height;
+
+    if (Strip > NumPoints) {
+        Info->Error = D_TGIF_ERR_BAD_RECT;
+        return TGIF_ERROR;
+    }
+    if (Strip > 0)
+        First = TGIF_RP_ROW(pgm_read_word(&Points[Strip - 1].RowBit));
+    if (Strip < NumPoints)
+        Last = TGIF_RP_ROW(pgm_read_word(&Points[Strip].RowBit));
+
+    return TDGifDecompressRect(Info, Points, NumPoints, 0, First, Info->Width, Last - First,
+                               (uint8_t*)Buf + (uint32_t)First * Stride, Stride, Format);
+}
+
+
+#if !defined(__AVR) && !defined(TDGIF_NO_THREADS)
+typedef struct TDGifStripJob {
+    const TGifInfo *Info;
+    const TGifRestartPoint *Points;
+    uint16_t NumPoints, Stride;
+    void *Buf;
+    uint8_t Format;
+    unsigned NextStrip;
+    int Error;
+} TDGifStripJob;
+
+static void *
+TDGifStripWorker(void *Arg)
+{
+    TDGifStripJob *Job = Arg;
+    unsigned Strip;
+
+    /* Take strips until there are none left, so the fast ones take more. */
+    while ((Strip = __atomic_fetch_add(&Job->NextStrip, 1, __ATOMIC_RELAXED)) <= Job->NumPoints) {
+        TGifInfo Info = *Job->Info;    /* Error is written per thread. */
+        Info.Workspace = NULL;         /* and one workspace can't be shared. */
+        if (TDGifDecompressStrip(&Info, Job->Points, Job->NumPoints, Strip,
+                                 Job->Buf, Job->Stride, Job->Format) == TGIF_ERROR)
+            __atomic_store_n(&Job->Error, Info.Error, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+#endif
+
+/******************************************************************************
+ Decode all the strips into a framebuffer, on up to Threads threads. The
+ threads would all refill the one TGifSource buffer, so an image read
+ through a TGifSource (or a build without threads) gets its strips decoded
+ one after another.
+******************************************************************************/
+int
+TDGifDecompressStrips(TGifInfo *Info, const TGifRestartPoint *Points, uint16_t NumPoints,
+                      void *Buf, uint16_t Stride, uint8_t Format, int Threads)
+{
+#if !defined(__AVR) && !defined(TDGIF_NO_THREADS)
+    if (!Info->Source && Threads > 1) {
+        TDGifStripJob Job = { Info, Points, NumPoints, Stride, Buf, Format, 0, 0 };
+        pthread_t Thread[Threads - 1];
+        int Started;
+
+        for (Started = 0; Started < Threads - 1 && Started < NumPoints; Started++) {
+            if (pthread_create(&Thread[Started], NULL, TDGifStripWorker, &Job))
+                break;
+        }
+        TDGifStripWorker(&Job);    /* This thread does its share too. */
+        while (Started--)
+            pthread_join(Thread[Started], NULL);
+
+        if (Job.Error) {
+            Info->Error = Job.Error;
+            return TGIF_ERROR;
+        }
+        return TGIF_OK;
+    }
+#else
+    (void)Threads;
+#endif
+    for (uint16_t Strip = 0; Strip <= NumPoints; Strip++) {
+        if (TDGifDecompressStrip(Info, Points, NumPoints, Strip, Buf, Stride, Format) == TGIF_ERROR)
+            return TGIF_ERROR;
+    }
+    return TGIF_OK;
+}
+
+
+/******************************************************************************
+ Resumable decoding: TDGifBegin, select an output, then call TDGifStep until
+ it stops returning TDGIF_MORE, and TDGifEnd to release the dictionary.
+ The dictionary has to outlive this call, so without a workspace it always
+ comes from malloc().
+******************************************************************************/
+int
+TDGifBegin(TDGifState *State, TGifInfo *Info)
+{
+    State->Alloc = NULL;    /* TDGifEnd is fine even if we fail early. */
+    if (TDGifInit(State, Info) == TGIF_ERROR)
+        return TGIF_ERROR;
+
+    uint8_t *Workspace;
+    if (TDGifWorkspace(State, &Workspace) == TGIF_ERROR)
+	return TGIF_ERROR;
+    if (Workspace) {
+	TDGifStart(State, Workspace);
+	return TGIF_OK;
+    }
+
+    uint8_t *Alloc = malloc(State->DictSize * 3 + State->StackSize);
+    if (!Alloc) {
+	Info->Error = D_TGIF_ERR_NOT_ENOUGH_MEM;
+	return TGIF_ERROR;
+    }
+    State->Alloc = Alloc;
+    TDGifStart(State, Alloc);
+    return TGIF_OK;
+}
+
+int
+TDGifStep(TDGifState *State, uint24_t MaxPixels)
+{
+    return TDGifRun(State, MaxPixels);
+}
+
+void
+TDGifEnd(TDGifState *State)
+{
+    free(State->Alloc);
+    State->Alloc = NULL;
+}
+
+
+/******************************************************************************
+ Tiny animations. Behind the magic is an image header, so that part is
+ parsed the same way, into the Frame every frame is decoded through.
+******************************************************************************/
+int
+TDGifGetAnimInfo(const void *TAnim, TGifAnimInfo *Anim, const uint16_t MaxW,
+                 const uint16_t MaxH, const uint16_t MaxSz)
+{
+    TGifInfo *Frame = &Anim->Frame;
+    uint8_t Header[4];
+
+    if (MaxSz < TGIF_ANIM_HEADER_SIZE + sizeof(TGifColorType) ||
+        TDGifReadByte(TAnim, 0) != TGIF_ANIM_MAGIC[0] ||
+        TDGifReadByte(TAnim, 1) != TGIF_ANIM_MAGIC[1]) {
+        Anim->Error = D_TGIF_ERR_NOT_ANIM;
+        return TGIF_ERROR;
+    }
+    /* No extensions in front of the header here */
+    TDGifNoExtensions(Frame);
+    for (uint8_t n = 0; n < 4; n++)
+        Header[n] = TDGifReadByte(TAnim, n + 2);
+    if (TDGifParseHeader(Frame, Header, MaxW, MaxH, MaxSz - 2) == TGIF_ERROR) {
+        Anim->Error = Frame->Error;
+        return TGIF_ERROR;
+    }
+    Anim->FrameCount = TDGifReadWord(TAnim, 6);
+    if (!Anim->FrameCount) {
+        Anim->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+    Anim->Width = Frame->Width;
+    Anim->Height = Frame->Height;
+    Anim->FrameNum = Anim->FrameCount;
+    Anim->X = Anim->Y = Anim->Delay = 0;
+    Anim->Data = TAnim;
+    Anim->Size = MaxSz;
+    Anim->Error = 0;
+    Frame->Source = NULL;
+    Frame->Workspace = NULL;
+    Frame->WorkspaceSize = 0;
+    Frame->Colors = (const TGifColorType*)((const uint8_t*)TAnim + TGIF_ANIM_HEADER_SIZE);
     return TGIF_OK;
 }
 
+/******************************************************************************
+ Go to the next frame: read its header and point Frame at its rectangle.
+******************************************************************************/
+int
+TDGifNextFrame(TGifAnimInfo *Anim)
+{
+    TGifInfo *Frame = &Anim->Frame;
+    uint16_t Offset = Anim->NextOffset, Len;
 
+    if (++Anim->FrameNum >= Anim->FrameCount) {
+        Anim->FrameNum = 0;
+        Offset = TGIF_ANIM_HEADER_SIZE + sizeof(TGifColorType) * Frame->ColorCount;
+    }
+    if (Anim->Size - Offset < TGIF_FRAME_HEADER_SIZE) {
+        Anim->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+    Anim->Delay = TDGifReadWord(Anim->Data, Offset);
+    Anim->X = TDGifReadWord(Anim->Data, Offset + 2);
+    Anim->Y = TDGifReadWord(Anim->Data, Offset + 4);
+    Frame->Width = TDGifReadWord(Anim->Data, Offset + 6);
+    Frame->Height = TDGifReadWord(Anim->Data, Offset + 8);
+    Len = TDGifReadWord(Anim->Data, Offset + 10);
+    Offset += TGIF_FRAME_HEADER_SIZE;
 
+    if (Len > Anim->Size - Offset) {
+        Anim->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+    if ((uint32_t)Anim->X + Frame->Width > Anim->Width ||
+        (uint32_t)Anim->Y + Frame->Height > Anim->Height) {
+        Anim->Error = D_TGIF_ERR_BAD_RECT;
+        return TGIF_ERROR;
+    }
+    Frame->Data = (const uint8_t*)Anim->Data + Offset;
+    Frame->DataOffset = Offset;
+    Frame->MaxSz = Len;
+    Anim->NextOffset = Offset + Len;
+    return TGIF_OK;
+}
 
+/******************************************************************************
+ Go to the next frame and decode its rectangle into the framebuffer of the
+ whole animation. The rest of it keeps what the frames before left there.
+******************************************************************************/
+int
+TDGifDecompressFrame(TGifAnimInfo *Anim, void *Buf, uint16_t Stride, uint8_t Format)
+{
+    TGifInfo *Frame = &Anim->Frame;
+    uint8_t PixelSize = Format == TDGIF_FMT_INDEX8 ? 1 : 2;
+
+    if (TDGifNextFrame(Anim) == TGIF_ERROR)
+        return TGIF_ERROR;
+    if (!Frame->Width || !Frame->Height)
+        return TGIF_OK;    /* Nothing changed, only time passes. */
+    if (TDGifDecompressToBuffer(Frame, (uint8_t*)Buf + (uint32_t)Anim->Y * Stride +
+                                Anim->X * PixelSize, Stride, Format) == TGIF_ERROR) {
+        Anim->Error = Frame->Error;
+        return TGIF_ERROR;
+    }
+    return TGIF_OK;
+}
+
+
+/******************************************************************************
+ Tiny archives. The directory has every image's header, so getting at one
+ is a lookup, and its palette is shared with others.
+******************************************************************************/
+static uint32_t TDGifReadLong(const void* base, uint32_t offset) {
+	const uint8_t *d = (const uint8_t*)base + offset;
+	return TDGifReadWord(d, 0) | ((uint32_t)TDGifReadWord(d, 2) << 16);
+}
+
+int
+TDGifOpenArchive(const void *TArchive, TGifArchive *Archive, const uint32_t Size)
+{
+    if (Size < TGIF_ARCHIVE_HEADER_SIZE ||
+        TDGifReadByte(TArchive, 0) != TGIF_ARCHIVE_MAGIC[0] ||
+        TDGifReadByte(TArchive, 1) != TGIF_ARCHIVE_MAGIC[1]) {
+        Archive->Error = D_TGIF_ERR_NOT_ARCHIVE;
+        return TGIF_ERROR;
+    }
+    Archive->Count = TDGifReadWord(TArchive, 2);
+    Archive->PaletteCount = TDGifReadWord(TArchive, 4);
+    if (TGIF_ARCHIVE_HEADER_SIZE + (uint32_t)Archive->Count * TGIF_ARCHIVE_ENTRY_SIZE +
+        (uint32_t)Archive->PaletteCount * 4 > Size) {
+        Archive->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+    Archive->Data = TArchive;
+    Archive->Size = Size;
+    Archive->Error = 0;
+    return TGIF_OK;
+}
+
+/* Where the directory entry of image Index is */
+static uint32_t TDGifArchiveEntry(uint16_t Index) {
+    return TGIF_ARCHIVE_HEADER_SIZE + (uint32_t)Index * TGIF_ARCHIVE_ENTRY_SIZE;
+}
+
+int
+TDGifArchiveFind(const TGifArchive *Archive, uint16_t Id)
+{
+    uint16_t Lo = 0, Hi = Archive->Count;
+
+    if (Id < Hi && TDGifReadWord((const uint8_t*)Archive->Data + TDGifArchiveEntry(Id), 0) == Id)
+        return Id;
+    while (Lo < Hi) {
+        uint16_t Mid = (Lo + Hi) / 2;
+        uint16_t MidId = TDGifReadWord((const uint8_t*)Archive->Data + TDGifArchiveEntry(Mid), 0);
+        if (MidId == Id)
+            return Mid;
+        if (MidId < Id)
+            Lo = Mid + 1;
+        else
+            Hi = Mid;
+    }
+    return -1;
+}
+
+/******************************************************************************
+ Same as TDGifGetInfo, for image number Index of the archive.
+******************************************************************************/
+int
+TDGifArchiveGetInfo(const TGifArchive *Archive, uint16_t Index, TGifInfo *Info,
+                    const uint16_t MaxW, const uint16_t MaxH)
+{
+    const uint8_t *Data = Archive->Data;
+    uint32_t Entry = TDGifArchiveEntry(Index), Offset, End, Colors;
+    uint8_t Header[4];
+
+    if (Index >= Archive->Count) {
+        Info->Error = D_TGIF_ERR_NOT_FOUND;
+        return TGIF_ERROR;
+    }
+    for (uint8_t n = 0; n < 4; n++)
+        Header[n] = TDGifReadByte(Data + Entry, 2 + n);
+    uint16_t ExtPalette = TDGifReadWord(Data + Entry, 6);
+    Offset = TDGifReadLong(Data, Entry + 8);
+    End = Index + 1 < Archive->Count ? TDGifReadLong(Data, Entry + TGIF_ARCHIVE_ENTRY_SIZE + 8)
+                                     : Archive->Size;
+    if (TGIF_AR_PALETTE(ExtPalette) >= Archive->PaletteCount) {
+        Info->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+    Colors = TDGifReadLong(Data, TDGifArchiveEntry(Archive->Count) +
+                           TGIF_AR_PALETTE(ExtPalette) * 4);
+    uint16_t ColorTableSize = sizeof(TGifColorType) * (Header[3] ? Header[3] : 256);
+    if (Offset > End || End > Archive->Size ||
+        Colors > Archive->Size || Archive->Size - Colors < ColorTableSize) {
+        Info->Error = D_TGIF_ERR_MAXSZ;
+        return TGIF_ERROR;
+    }
+
+    TDGifNoExtensions(Info);
+    for (uint8_t n = TGIF_AR_EXTS(ExtPalette); n; n--) {
+        uint8_t Ext[4];
+        if (End - Offset < TGIF_EXT_SIZE) {
+            Info->Error = D_TGIF_ERR_MAXSZ;
+            return TGIF_ERROR;
+        }
+        for (uint8_t i = 0; i < 4; i++)
+            Ext[i] = TDGifReadByte(Data + Offset, i);
+        if (!TDGifParseExtension(Info, Ext)) {
+            Info->Error = D_TGIF_ERR_MAXSZ;
+            return TGIF_ERROR;
+        }
+        Offset += TGIF_EXT_SIZE;
+    }
+
+    /* As if the header and palette were right in front of the data */
+    uint32_t MaxSz = End - Offset + 4 + ColorTableSize;
+    if (TDGifParseHeader(Info, Header, MaxW, MaxH, MaxSz > 0xFFFF ? 0xFFFF : MaxSz) == TGIF_ERROR)
+        return TGIF_ERROR;
+
+    Info->Source = NULL;
+    Info->Workspace = NULL;
+    Info->WorkspaceSize = 0;
+    Info->Colors = (const TGifColorType*)(Data + Colors);
+    Info->Data = Data + Offset;
+    Info->DataOffset = 0;
+    return TGIF_OK;
+}
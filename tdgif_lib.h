@@ -2,23 +2,234 @@
 
 #include "tgif_lib.h"
 
+#ifdef __AVR
+typedef __uint24 uint24_t;
+#else
+typedef uint32_t uint24_t;
+#endif
+
+/* Input for images that are not directly addressable (SPI flash, SD card,
+ * paged storage...). Read copies up to Len bytes from Offset within the
+ * image into Buf and returns how many it got, 0 on failure. The decoder
+ * reads the data in BufSize blocks through the refill buffer Buf. */
+typedef struct TGifSource {
+    uint16_t (*Read)(void *Ctx, uint16_t Offset, uint8_t *Buf, uint16_t Len);
+    void *Ctx;
+    uint8_t *Buf;
+    uint16_t BufSize;
+} TGifSource;
+
 typedef struct TGifInfo {
     uint16_t Width;
     uint16_t Height;
     uint16_t SRAMLimit;
     int ColorCount;
     const TGifColorType *Colors;
+    int Transparent;                 /* Transparent color index, -1 if none */
+    int PresetId;                    /* Preset dictionary it needs, -1 if none */
+    const uint8_t *Preset;           /* and that, see TDGifSetPreset */
     const void* Data;
+    const TGifSource *Source;        /* NULL if Data is directly addressable */
     int Error;			     /* Last error condition reported */
     uint16_t MaxSz;
+    uint16_t DataOffset;             /* Where Data is within the image */
+    uint8_t *Workspace;              /* Dictionary memory, NULL to allocate per decode */
+    uint16_t WorkspaceSize;
 } TGifInfo;
 
+/* Dictionary memory needed by an image of the given SRAMLimit; no image
+ * needs more than TDGIF_MAX_WORKSPACE, but for the longest string of its
+ * preset dictionary, if it has one. */
+#define TDGIF_WORKSPACE_SIZE(SRAMLimit) ((SRAMLimit) & ~3)
+#define TDGIF_MAX_WORKSPACE       4096
+
 #define D_TGIF_ERR_MAXSZ          20 /* Maximum size too small / file truncated or corrupt */
 #define D_TGIF_ERR_ZWH            21 /* Zero Width or Height */
 #define D_TGIF_ERR_TOOBIG         22 /* MaxW or MaxH exceeded */
 #define D_TGIF_ERR_NOT_ENOUGH_MEM 23
 #define D_TGIF_ERR_IMAGE_DEFECT   24
+#define D_TGIF_ERR_BAD_FORMAT     25 /* Unknown framebuffer format, or no colors for it */
+#define D_TGIF_ERR_READ           26 /* TGifSource read failed */
+#define D_TGIF_ERR_BAD_RECT       27 /* Rectangle not within the image */
+#define D_TGIF_ERR_NOT_ANIM       28 /* Not a tiny animation */
+#define D_TGIF_ERR_NOT_ARCHIVE    29 /* Not a tiny archive */
+#define D_TGIF_ERR_NOT_FOUND      30 /* No such image in the archive */
+#define D_TGIF_ERR_PRESET         31 /* Not the preset dictionary the image needs, or none */
+#define D_TGIF_ERR_BAD_SCALE      32 /* Scale factor or filter not possible for the output */
+
+/* Framebuffer formats for TDGifDecompressToBuffer */
+#define TDGIF_FMT_INDEX8          0 /* One palette index byte per pixel */
+#define TDGIF_FMT_RGB565          1 /* Palette color, native byte order */
+#define TDGIF_FMT_RGB565_SWAP     2 /* Palette color, byte-swapped (big-endian displays) */
+
+#define TDGIF_MORE                2 /* TDGifStep: stopped early, call again */
+
+/* Downscale filters for TDGifSetScale/TDGifDecompressScaled */
+#define TDGIF_SCALE_NEAREST       0 /* Top left pixel of each Scale x Scale block */
+#define TDGIF_SCALE_BOX           1 /* Average color of the block (RGB565 framebuffers only) */
+#define TDGIF_MAX_BOX_SCALE       5 /* Sums have room for 32 pixels */
+/* Width or height of Size pixels, scaled down: blocks cut off by the edge
+ * still make an output pixel */
+#define TDGIF_SCALED(Size, Scale) (((Size) + (Scale) - 1) / (Scale))
+
+/* Decoder state for TDGifBegin/TDGifStep/TDGifEnd. Don't mess with this! */
+typedef struct TDGifState {
+    TGifInfo *Info;
+    uint16_t *Prefix;
+    uint8_t *Suffix,
+        *Stack,
+        *Alloc;        /* Dictionary memory we have to free, if any. */
+    void (*PixelCB)(uint8_t);
+    void (*SpanCB)(const uint8_t *, uint16_t);
+    void (*OpaqueCB)(uint16_t, uint16_t, const uint8_t *, uint16_t);
+    uint8_t *Row;      /* Framebuffer output: start of the current row, */
+    uint16_t Stride;   /* and the distance between rows, in bytes. */
+    uint16_t X, Y;     /* Where the next pixel is in the image, */
+    uint16_t ClipX, ClipY, ClipW, ClipH;   /* and the part to output. */
+    uint32_t *Sums;    /* Box filter: color sums of the output row, */
+    uint8_t Format,    /* TDGIF_FMT_* */
+        Positioned,    /* Output needs X, Y tracked. */
+        Scale,         /* Downscale factor, 1 if none, */
+        SubY;          /* and how many rows into the block Y is. */
+#ifndef __AVR
+    uint32_t Lut[256]; /* Palette in output format, for the gather, */
+    uint8_t Avx2;      /* which can go 8 at a time on this CPU. */
+#endif
+    const uint8_t *InPtr,      /* Input bytes not yet used */
+        *InEnd;
+    const uint8_t *Preset;     /* Preset entries (in flash on AVR), if any */
+    uint16_t
+        InOffset,    /* Data offset of InEnd. */
+        ClearCode,   /* The CLEAR LZ code. */
+        RunningCode, /* The next code algorithm can generate. */
+        MaxCode1,    /* 1 bigger than max. possible code, in RunningBits bits. */
+        MaxCodePoint,
+	DictBase,    /* The first code in Prefix[]/Suffix[], after any preset ones. */
+	DictSize,
+        StackSize,   /* DictSize, plus the longest preset string. */
+        NextCode,    /* The next dictionary entry to be defined. */
+        LastCode,    /* The previous code, to build the next entry from. */
+        StackPtr;    /* Start of the string still waiting on the stack. */
+#ifdef __AVR
+    uint24_t CrntShiftDWord;   /* For bytes decomposition into codes. */
+#else
+    uint64_t CrntShiftDWord;   /* Hosts read up to 8 bytes at a time. */
+#endif
+    uint24_t Pixel,            /* Pixels output so far */
+        PixelCount;            /* out of this many. */
+    uint8_t
+        RunningBits,
+        InitCodeBits,
+	MaxCodeBits,
+        CrntShiftState,    /* Number of bits in CrntShiftDWord. */
+        LastFirst,   /* First pixel of the string LastCode stands for. */
+        InRam;       /* Input (and colors) come from RAM, not flash. */
+} TDGifState;
 
 int TDGifGetInfo(const void *TGif, TGifInfo *Info, const uint16_t MaxW,
 	const uint16_t MaxH, const uint16_t MaxSz);
+int TDGifGetInfoSource(const TGifSource *Source, TGifInfo *Info, const uint16_t MaxW,
+	const uint16_t MaxH, const uint16_t MaxSz);
+int TDGifLoadColors(TGifInfo *Info, TGifColorType *Colors);
+/* Images encoded with a preset dictionary (see tgif_lib.h, Size bytes, in
+ * flash on AVR) need the same one to decode: set it after TDGifGetInfo,
+ * before sizing a workspace. Images without one ignore it. */
+int TDGifSetPreset(TGifInfo *Info, const uint8_t *Preset, uint16_t Size);
+/* Decode with the dictionary in Buf instead of allocating one each time.
+ * Call after TDGifGetInfo, Buf (16-bit aligned) can be reused for the next
+ * image. */
+uint16_t TDGifWorkspaceSize(const TGifInfo *Info);
+int TDGifSetWorkspace(TGifInfo *Info, uint8_t *Buf, uint16_t Size);
 int TDGifDecompress(TGifInfo *Info, void(*OutputCB)(uint8_t) );
+/* Same, but SpanCB gets whole decoded strings (valid only during the call) */
+int TDGifDecompressSpans(TGifInfo *Info, void(*SpanCB)(const uint8_t *, uint16_t) );
+/* Or only the runs of pixels that are not transparent, at X,Y */
+int TDGifDecompressOpaque(TGifInfo *Info,
+	void(*OpaqueCB)(uint16_t X, uint16_t Y, const uint8_t *, uint16_t) );
+/* Or straight into a caller-owned framebuffer, Stride bytes per row (for
+ * the RGB565 formats, Buf 16-bit aligned and Stride even) */
+int TDGifDecompressToBuffer(TGifInfo *Info, void *Buf, uint16_t Stride, uint8_t Format);
+/* Or just a rectangle of it, see TDGifSetRect */
+int TDGifDecompressRect(TGifInfo *Info, const TGifRestartPoint *Points, uint16_t NumPoints,
+	uint16_t X, uint16_t Y, uint16_t W, uint16_t H,
+	void *Buf, uint16_t Stride, uint8_t Format);
+/* Or scaled down by an integer factor (see TDGifSetScale) into Buf, of
+ * TDGIF_SCALED(Width, Scale) x TDGIF_SCALED(Height, Scale). With Filter
+ * TDGIF_SCALE_NEAREST, the restart points (if any) are used to skip the
+ * strips that have no row to output, and the rows after the last one. */
+int TDGifDecompressScaled(TGifInfo *Info, const TGifRestartPoint *Points, uint16_t NumPoints,
+	uint8_t Scale, uint8_t Filter, void *Buf, uint16_t Stride, uint8_t Format);
+/* Or the strips between restart points: one of them, or all of them, on a
+ * host spread over Threads threads. Not with a TGifSource, whose one buffer
+ * the threads can't share: its strips are decoded one after another, as
+ * they are without threads (AVR, TDGIF_NO_THREADS). */
+int TDGifDecompressStrip(TGifInfo *Info, const TGifRestartPoint *Points, uint16_t NumPoints,
+	uint16_t Strip, void *Buf, uint16_t Stride, uint8_t Format);
+int TDGifDecompressStrips(TGifInfo *Info, const TGifRestartPoint *Points, uint16_t NumPoints,
+	void *Buf, uint16_t Stride, uint8_t Format, int Threads);
+
+/* Tiny animations (see tgif_lib.h). Frame is the frame last gone to, as
+ * an image of just the rectangle it changes: decode it at X,Y, or let
+ * TDGifDecompressFrame do that. Set a workspace on Frame once, if any. */
+typedef struct TGifAnimInfo {
+    uint16_t Width;
+    uint16_t Height;
+    uint16_t FrameCount;
+    uint16_t FrameNum;               /* Of Frame, FrameCount before the first */
+    uint16_t X, Y;                   /* Where Frame goes */
+    uint16_t Delay;                  /* and how long to show it, in 1/100 s */
+    TGifInfo Frame;
+    const void *Data;
+    uint16_t Size;
+    uint16_t NextOffset;             /* Of the frame after Frame */
+    int Error;
+} TGifAnimInfo;
+
+int TDGifGetAnimInfo(const void *TAnim, TGifAnimInfo *Anim, const uint16_t MaxW,
+	const uint16_t MaxH, const uint16_t MaxSz);
+/* Go to the next frame, after the last back to the first */
+int TDGifNextFrame(TGifAnimInfo *Anim);
+/* Go to the next frame and decode it into Buf, a framebuffer of the whole
+ * animation that still holds the frame before. Only its rectangle is
+ * written. */
+int TDGifDecompressFrame(TGifAnimInfo *Anim, void *Buf, uint16_t Stride, uint8_t Format);
+
+/* Tiny archives (see tgif_lib.h), memory mapped or in flash. Find an
+ * image by Id, then get its info by index and decode it like any other. */
+typedef struct TGifArchive {
+    const void *Data;
+    uint32_t Size;
+    uint16_t Count;                  /* Images */
+    uint16_t PaletteCount;
+    int Error;
+} TGifArchive;
+
+int TDGifOpenArchive(const void *TArchive, TGifArchive *Archive, const uint32_t Size);
+/* The index of the image Id, -1 if there is none. Immediate if the Ids
+ * are 0, 1, 2..., a binary search otherwise. */
+int TDGifArchiveFind(const TGifArchive *Archive, uint16_t Id);
+int TDGifArchiveGetInfo(const TGifArchive *Archive, uint16_t Index, TGifInfo *Info,
+	const uint16_t MaxW, const uint16_t MaxH);
+
+/* Resumable decoding: Begin, pick an output, Step until it stops returning
+ * TDGIF_MORE (each call decodes at most MaxPixels pixels), then End (also
+ * safe after a failed Begin). The workspace, if set, must stay around until
+ * End. */
+int TDGifBegin(TDGifState *State, TGifInfo *Info);
+void TDGifSetPixelOutput(TDGifState *State, void(*OutputCB)(uint8_t) );
+void TDGifSetSpanOutput(TDGifState *State, void(*SpanCB)(const uint8_t *, uint16_t) );
+void TDGifSetOpaqueOutput(TDGifState *State,
+	void(*OpaqueCB)(uint16_t X, uint16_t Y, const uint8_t *, uint16_t) );
+int TDGifSetBufferOutput(TDGifState *State, void *Buf, uint16_t Stride, uint8_t Format);
+/* Only output the W x H rectangle at X,Y, starting at the nearest of the
+ * restart points from TEGifGetRestartPoints (in flash on AVR) */
+int TDGifSetRect(TDGifState *State, const TGifRestartPoint *Points, uint16_t NumPoints,
+	uint16_t X, uint16_t Y, uint16_t W, uint16_t H);
+/* Scale the output (of the rectangle, if any) down by Scale: a block of
+ * Scale x Scale pixels becomes one, at X/Scale, Y/Scale. Nearest just
+ * passes on the top left pixel of each; Box averages the colors into Sums,
+ * TDGIF_SCALED(W, Scale) of them, for an RGB565 framebuffer. After the
+ * output is picked, before the first TDGifStep. */
+int TDGifSetScale(TDGifState *State, uint8_t Scale, uint8_t Filter, uint32_t *Sums);
+int TDGifStep(TDGifState *State, uint24_t MaxPixels);
+void TDGifEnd(TDGifState *State);
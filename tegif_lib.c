@@ -12,36 +12,42 @@ tegif_lib.c - Tiny "GIF" encoding
 #include <sys/stat.h>
 
 #include "tegif_lib.h"
-
-/* Hash table details */
-#define HT_SIZE			8192	   /* 12bits = 4096 or twice as big! */
-#define HT_KEY_MASK		0x1FFF			      /* 13bits keys */
-#define HT_KEY_NUM_BITS		13			      /* 13bits keys */
-#define HT_MAX_KEY		8191	/* 13bits - 1, maximal code possible */
-#define HT_MAX_CODE		4095	/* Biggest code possible in 12 bits. */
-
-/* The 32 bits of the long are divided into two parts for the key & code:   */
-/* 1. The code is 12 bits as our compression algorithm is limited to 12bits */
-/* 2. The key is 12 bits Prefix code + 8 bit new char or 20 bits.	    */
-/* The key is the upper 20 bits.  The code is the lower 12. */
-#define HT_GET_KEY(l)	(l >> 12)
-#define HT_GET_CODE(l)	(l & 0x0FFF)
-#define HT_PUT_KEY(l)	(l << 12)
-#define HT_PUT_CODE(l)	(l & 0x0FFF)
-
-typedef struct TGifHashTableType {
-    uint32_t HTable[HT_SIZE];
-} TGifHashTableType;
-
-static TGifHashTableType *_InitHashTable(void);
-static void _ClearHashTable(TGifHashTableType *HashTable);
-static void _InsertHashTable(TGifHashTableType *HashTable, uint32_t Key, int Code);
-static int _ExistsHashTable(TGifHashTableType *HashTable, uint32_t Key);
-
-/* Other private stuff */
-
 #include "tgif_lib_private.h"
 
+/* Code table details: for every code, the code of that string plus each  */
+/* pixel value, straight indexed by [code][pixel] - no hashing or probing. */
+/* Each slot also holds the generation it was written in, and only slots   */
+/* of the current generation are in use, so a clear is a new generation.  */
+#define CT_CODE_BITS		LZ_BITS
+#define CT_MAX_GENERATION	(UINT32_MAX >> CT_CODE_BITS)
+#define CT_GET_GENERATION(l)	((l) >> CT_CODE_BITS)
+#define CT_GET_CODE(l)		((l) & LZ_MAX_CODE)
+#define CT_PUT(Generation, Code) (((uint32_t)(Generation) << CT_CODE_BITS) | (Code))
+
+typedef struct TGifCodeTableType {
+    uint32_t Generation;
+    size_t Slots;             /* Allocated, of which we use MaxCodePoint rows. */
+    uint8_t PixelBits;        /* Columns per code are 1 << PixelBits. */
+    uint32_t Next[];          /* [code][pixel] -> CT_PUT of the code of both. */
+} TGifCodeTableType;
+
+static TGifCodeTableType *_InitCodeTable(TGifCodeTableType *CodeTable,
+                                         int MaxCodePoint, int ColorCount);
+static void _ClearCodeTable(TGifCodeTableType *CodeTable);
+static int _LookupCodeTable(const TGifCodeTableType *CodeTable, int Code,
+                            TGifPixelType Pixel);
+static void _InsertCodeTable(TGifCodeTableType *CodeTable, int Code,
+                             TGifPixelType Pixel, int NewCode);
+static void _RemoveCodeTable(TGifCodeTableType *CodeTable, int Code,
+                             TGifPixelType Pixel);
+
+/* Flexible parse: how many of the longest strings to try, and how far */
+#define TEGIF_FLEX_TRIES	4
+#define TEGIF_FLEX_WINDOW	32
+
+/* Bytes of output collected before it is handed to the file or callback */
+#define TEGIF_OUT_BUF_SIZE	16384
+
 /* Private details for the encoder */
 typedef struct TGifFilePrivateType {
     TGifWord FileState,  /* Where all this data goes to! */
@@ -52,116 +58,175 @@ typedef struct TGifFilePrivateType {
       RunningBits, /* The number of bits required to represent RunningCode. */
       MaxCode1,    /* 1 bigger than max. possible code, in RunningBits bits. */
       MaxCodePoint, /* Maximum code actually used ever, for decoder SRAM limiting. */
+      MaxCodeBits, /* Codes never need more bits than this, nor does the decoder read more. */
       CrntCode,    /* Current algorithm code. */
       CrntShiftState;    /* Number of bits in CrntShiftDWord. */
     unsigned long CrntShiftDWord;   /* For bytes decomposition into codes. */
     unsigned long PixelCount;   /* Number of pixels in image. */
-    FILE *File;    /* File as stream. */
-    TGifByteType Buf[256];   /* Compressed input is buffered here. */
-    TGifHashTableType *HashTable;
+    unsigned long DataBytes;    /* LZW data bytes output so far. */
+    unsigned long RestartLeft;  /* Pixels to go until the next restart point. */
+    unsigned long PixelsDone,   /* Pixels compressed before this line. */
+      ClearPixel,   /* Adaptive clears: where the dictionary was cleared, */
+      ClearBits,    /* and how many bits were output by then. */
+      FillPixels,   /* What it took to fill it up, 0 if it isn't yet. */
+      FillBits,
+      WinPixel,     /* Start of the current check window, */
+      WinBits,
+      CheckAt,      /* and its end. */
+      CheckGap;
+    int ClearPolicy;
+    int Parse;
+    int MaxError;            /* Lossy: how far off a pixel's color may be, */
+    TGifPixelType *Near;     /* and for each color, the ones that close, */
+    uint8_t NearCount[256];  /* nearest first, or NULL if lossless. */
+    int Transparent;         /* Transparent color index, -1 for none. */
+    const TGifByteType *Preset;  /* Preset dictionary, or NULL, */
+    int PresetCount,         /* the entries of it this image uses, */
+      PresetMaxLen;          /* and the longest string in those (at least 1). */
+    TGifPixelType *Image;    /* Flexible parse: the whole image, */
+    unsigned long ImageLen, ImageSize;   /* as much of it as we got so far. */
+    uint16_t Width,
+      RestartRows,  /* Rows between restart points, 0 for none. */
+      Strips,       /* Or the number of strips to get them from. */
+      RestartRow,   /* Row of the next restart point. */
+      NumRestarts;
+    TGifRestartPoint *Restarts;
+    FILE *File;    /* File as stream, if we opened one. */
+    TEGifOutputFunc Output;  /* Where all the bytes go, or NULL for File. */
+    TGifByteType **MemData;  /* TEGifOpenMemory: the caller's pointers, */
+    size_t *MemLen;
+    TGifByteType *Mem;       /* and what they get at close. */
+    size_t MemUsed, MemSize;
+    int OutLen;
+    TGifByteType Out[TEGIF_OUT_BUF_SIZE];   /* All output is buffered here, */
+    TGifByteType Buf[256];   /* and compressed output in 255 byte blocks first. */
+    TGifCodeTableType *CodeTable;
 } TGifFilePrivateType;
 
 
-/* Hash table impl. */
-static int KeyItem(uint32_t Item);
+/* Code table impl. */
 
 /******************************************************************************
- Initialize HashTable - allocate the memory needed and clear it.	      *
+ Get an empty code table for codes below MaxCodePoint and pixels below       *
+ ColorCount: the old one CodeTable, if it is big enough, or a new one.      *
+ A fresh one is empty because generation 0 is never the current one.	      *
 ******************************************************************************/
-static TGifHashTableType *_InitHashTable(void)
+static TGifCodeTableType *_InitCodeTable(TGifCodeTableType *CodeTable,
+                                         int MaxCodePoint, int ColorCount)
 {
-    TGifHashTableType *HashTable;
+    uint8_t PixelBits = 0;
+    size_t Slots;
 
-    if ((HashTable = (TGifHashTableType *) malloc(sizeof(TGifHashTableType)))
-	== NULL)
-	return NULL;
+    while ((1 << PixelBits) < ColorCount)
+	PixelBits++;
+    Slots = (size_t)MaxCodePoint << PixelBits;
+
+    if (CodeTable && CodeTable -> Slots >= Slots) {
+	CodeTable -> PixelBits = PixelBits;
+	_ClearCodeTable(CodeTable);
+	return CodeTable;
+    }
 
-    _ClearHashTable(HashTable);
+    free(CodeTable);
+    if ((CodeTable = (TGifCodeTableType *) calloc(1, sizeof(TGifCodeTableType) +
+	    Slots * sizeof(uint32_t))) == NULL)
+	return NULL;
 
-    return HashTable;
+    CodeTable -> Slots = Slots;
+    CodeTable -> PixelBits = PixelBits;
+    CodeTable -> Generation = 1;
+    return CodeTable;
 }
 
 /******************************************************************************
- Routine to clear the HashTable to an empty state.			      *
- This part is a little machine depended. Use the commented part otherwise.   *
+ Routine to clear the CodeTable to an empty state.			      *
+ O(1) but once every few million clears, when the generation wraps.	      *
 ******************************************************************************/
-static void _ClearHashTable(TGifHashTableType *HashTable)
+static void _ClearCodeTable(TGifCodeTableType *CodeTable)
 {
-    memset(HashTable -> HTable, 0xFF, HT_SIZE * sizeof(uint32_t));
+    if (++CodeTable -> Generation > CT_MAX_GENERATION) {
+	memset(CodeTable -> Next, 0, CodeTable -> Slots * sizeof(uint32_t));
+	CodeTable -> Generation = 1;
+    }
 }
 
 /******************************************************************************
- Routine to insert a new Item into the HashTable. The data is assumed to be  *
- new one.								      *
+ Routine to find the code of string Code followed by Pixel, if it has one.  *
+ Returns the code if it was found, -1 if not.				      *
+ Pixel values past ColorCount wrap around into another column; the stream  *
+ is garbage then anyway, but we stay within the table.			      *
 ******************************************************************************/
-static void _InsertHashTable(TGifHashTableType *HashTable, uint32_t Key, int Code)
+static int _LookupCodeTable(const TGifCodeTableType *CodeTable, int Code,
+                            TGifPixelType Pixel)
 {
-    int HKey = KeyItem(Key);
-    uint32_t *HTable = HashTable -> HTable;
+    int Mask = (1 << CodeTable -> PixelBits) - 1;
+    uint32_t Slot = CodeTable -> Next[(Code << CodeTable -> PixelBits) | (Pixel & Mask)];
 
-    while (HT_GET_KEY(HTable[HKey]) != 0xFFFFFL) {
-	HKey = (HKey + 1) & HT_KEY_MASK;
-    }
-    HTable[HKey] = HT_PUT_KEY(Key) | HT_PUT_CODE(Code);
+    if (CT_GET_GENERATION(Slot) == CodeTable -> Generation)
+	return CT_GET_CODE(Slot);
+    return -1;
 }
 
 /******************************************************************************
- Routine to test if given Key exists in HashTable and if so returns its code *
- Returns the Code if key was found, -1 if not.				      *
+ Routine to forget string Code followed by Pixel again.			      *
 ******************************************************************************/
-static int _ExistsHashTable(TGifHashTableType *HashTable, uint32_t Key)
+static void _RemoveCodeTable(TGifCodeTableType *CodeTable, int Code,
+                             TGifPixelType Pixel)
 {
-    int HKey = KeyItem(Key);
-    uint32_t *HTable = HashTable -> HTable, HTKey;
-
-    while ((HTKey = HT_GET_KEY(HTable[HKey])) != 0xFFFFFL) {
-	if (Key == HTKey) return HT_GET_CODE(HTable[HKey]);
-	HKey = (HKey + 1) & HT_KEY_MASK;
-    }
+    int Mask = (1 << CodeTable -> PixelBits) - 1;
 
-    return -1;
+    CodeTable -> Next[(Code << CodeTable -> PixelBits) | (Pixel & Mask)] = 0;
 }
 
 /******************************************************************************
- Routine to generate an HKey for the hashtable out of the given unique key.  *
- The given Key is assumed to be 20 bits as follows: lower 8 bits are the     *
- new postfix character, while the upper 12 bits are the prefix code.	      *
- Because the average hit ratio is only 2 (2 hash references per entry),      *
- evaluating more complex keys (such as twin prime keys) does not worth it!   *
+ Routine to define NewCode as string Code followed by Pixel.		      *
 ******************************************************************************/
-static int KeyItem(uint32_t Item)
+static void _InsertCodeTable(TGifCodeTableType *CodeTable, int Code,
+                             TGifPixelType Pixel, int NewCode)
 {
-    return ((Item >> 12) ^ Item) & HT_KEY_MASK;
+    int Mask = (1 << CodeTable -> PixelBits) - 1;
+
+    CodeTable -> Next[(Code << CodeTable -> PixelBits) | (Pixel & Mask)] =
+	CT_PUT(CodeTable -> Generation, NewCode);
 }
 
 static int TEGifSetupCompress(TGifFileType * GifFile, uint16_t sram_limit);
 static int TEGifCompressLine(TGifFileType * GifFile, TGifPixelType * Line,
                             int LineLen);
 static int TEGifCompressOutput(TGifFileType * GifFile, int Code);
+static int TEGifPutCode(TGifFileType * GifFile, int Code, TGifPixelType Pixel,
+                        unsigned long Pos);
+static int TEGifPutLastCode(TGifFileType * GifFile, int Code);
+static int TEGifSetupLossy(TGifFileType * GifFile, const TColorMapObject *ColorMap);
+static int TEGifLookupNear(const TGifFilePrivateType *Private, int Code,
+                           TGifPixelType Pixel);
+static int TEGifMatch(const TGifFilePrivateType *Private, const TGifPixelType *Pixels,
+                      unsigned long Len, int *Codes);
+static int TEGifFlexTrial(TGifFilePrivateType *Private, const TGifPixelType *Pixels,
+                          unsigned long Len, int Code, int Length, unsigned long *Reach);
+static int TEGifCompressFlexible(TGifFileType * GifFile, const TGifPixelType * Image,
+                                 unsigned long Len);
+static int TEGifRestart(TGifFileType * GifFile, int CrntCode);
+static void TEGifClearCodes(TGifFilePrivateType *Private);
+static void TEGifStartRatio(TGifFilePrivateType *Private, unsigned long Pixel);
+static int TEGifRatioDropped(TGifFilePrivateType *Private, unsigned long Pixel);
 static int TEGifBufferedOutput(TGifFileType * GifFile, TGifByteType * Buf,
                               int c);
 
 
 /******************************************************************************
- Open a new GIF file for write, specified by name.
- Returns a dynamically allocated TGifFileType pointer which serves as the GIF
- info record.
+ Allocate the GIF info record and its private part, writing to Output (or
+ to File, if Output is NULL).
 ******************************************************************************/
-TGifFileType *
-TEGifOpenFileName(const char *FileName, int *Error)
+static TGifFileType *
+TEGifOpenInternal(FILE *File, TEGifOutputFunc Output, void *UserData, int *Error)
 {
-
     TGifFileType *GifFile;
-    FILE *f = fopen(FileName, "wb");
-
-    if (!f) {
-        if (Error != NULL)
-	    *Error = E_TGIF_ERR_OPEN_FAILED;
-        return NULL;
-    }
 
     GifFile = (TGifFileType *) malloc(sizeof(TGifFileType));
     if (GifFile == NULL) {
+        if (Error != NULL)
+	    *Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
         return NULL;
     }
 
@@ -175,34 +240,142 @@ TEGifOpenFileName(const char *FileName, int *Error)
         return NULL;
     }
     /*@i1@*/memset(Private, '\0', sizeof(TGifFilePrivateType));
-    if ((Private->HashTable = _InitHashTable()) == NULL) {
-        free(GifFile);
-        free(Private);
-        if (Error != NULL)
-	    *Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
-        return NULL;
-    }
 
     GifFile->Private = (void *)Private;
-    Private->File = f;
+    GifFile->UserData = UserData;
+    Private->File = File;
+    Private->Output = Output;
     Private->FileState = FILE_STATE_WRITE;
+    Private->Transparent = -1;
+    Private->PresetMaxLen = 1;
 
     GifFile->Error = 0;
 
     return GifFile;
 }
 
+/******************************************************************************
+ Open a new GIF file for write, specified by name.
+ Returns a dynamically allocated TGifFileType pointer which serves as the GIF
+ info record.
+******************************************************************************/
+TGifFileType *
+TEGifOpenFileName(const char *FileName, int *Error)
+{
+
+    TGifFileType *GifFile;
+    FILE *f = fopen(FileName, "wb");
+
+    if (!f) {
+        if (Error != NULL)
+	    *Error = E_TGIF_ERR_OPEN_FAILED;
+        return NULL;
+    }
+
+    GifFile = TEGifOpenInternal(f, NULL, NULL, Error);
+    if (GifFile == NULL)
+        fclose(f);
+    return GifFile;
+}
+
+/******************************************************************************
+ Output function for TEGifOpenMemory: append to a buffer, doubling it as
+ needed.
+******************************************************************************/
+static int
+TEGifMemoryOutput(TGifFileType *GifFile, const TGifByteType *Buf, int Len)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (Private->MemUsed + Len > Private->MemSize) {
+        size_t Size = Private->MemSize ? Private->MemSize : TEGIF_OUT_BUF_SIZE;
+        while (Private->MemUsed + Len > Size)
+            Size *= 2;
+        TGifByteType *Mem = realloc(Private->Mem, Size);
+        if (!Mem)
+            return 0;
+        Private->Mem = Mem;
+        Private->MemSize = Size;
+    }
+    memcpy(Private->Mem + Private->MemUsed, Buf, Len);
+    Private->MemUsed += Len;
+    return Len;
+}
 
 /******************************************************************************
- All writes to the GIF should go through this.
+ Open a new GIF for write into memory. Data and Len are filled in by
+ TEGifCloseFile, if it succeeds.
+******************************************************************************/
+TGifFileType *
+TEGifOpenMemory(TGifByteType **Data, size_t *Len, int *Error)
+{
+    TGifFileType *GifFile = TEGifOpenInternal(NULL, TEGifMemoryOutput, NULL, Error);
+
+    if (GifFile != NULL) {
+        TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+        Private->MemData = Data;
+        Private->MemLen = Len;
+    }
+    return GifFile;
+}
+
+/******************************************************************************
+ Open a new GIF for write through OutputFunc, which can find UserData in
+ the TGifFileType it gets.
+******************************************************************************/
+TGifFileType *
+TEGifOpenCallback(void *UserData, TEGifOutputFunc OutputFunc, int *Error)
+{
+    if (OutputFunc == NULL) {
+        if (Error != NULL)
+	    *Error = E_TGIF_ERR_OPEN_FAILED;
+        return NULL;
+    }
+    return TEGifOpenInternal(NULL, OutputFunc, UserData, Error);
+}
+
+
+/******************************************************************************
+ Hand everything in Out over to the file or output function.
+******************************************************************************/
+static int TEGifFlushOut(TGifFileType *GifFile)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType*)GifFile->Private;
+    int Len = Private->OutLen, r;
+
+    if (!Len)
+        return TGIF_OK;
+    Private->OutLen = 0;
+    if (Private->Output)
+        r = Private->Output(GifFile, Private->Out, Len);
+    else
+        r = fwrite(Private->Out, 1, Len, Private->File);
+    return r == Len ? TGIF_OK : TGIF_ERROR;
+}
+
+/******************************************************************************
+ All writes to the GIF should go through this. They are only collected in
+ Out, and leave once it fills up or the file is closed.
 ******************************************************************************/
 static int InternalWrite(TGifFileType *GifFileOut,
 		   const void *buf, size_t len)
 {
     TGifFilePrivateType *Private = (TGifFilePrivateType*)GifFileOut->Private;
-    int r = fwrite(buf, 1, len, Private->File);
-    fflush(Private->File);
-    return r;
+    const TGifByteType *b = buf;
+    size_t left = len;
+
+    while (left) {
+        size_t n = TEGIF_OUT_BUF_SIZE - Private->OutLen;
+        if (n > left) n = left;
+        memcpy(Private->Out + Private->OutLen, b, n);
+        Private->OutLen += n;
+        b += n;
+        left -= n;
+        if (Private->OutLen == TEGIF_OUT_BUF_SIZE &&
+            TEGifFlushOut(GifFileOut) == TGIF_ERROR)
+            return 0;
+    }
+    return len;
 }
 
 /* return smallest bitfield size n will fit in */
@@ -232,9 +405,35 @@ TEGifPutScreenDesc(TGifFileType *GifFile,
         return TGIF_ERROR;
     }
 
-    if (!ColorMap)
+    if (!ColorMap || Private->Transparent >= ColorMap->ColorCount)
 	return TGIF_ERROR;
 
+    /* Extensions go first, they are not part of the header proper */
+    if (Private->Transparent >= 0) {
+        Buf[0] = Buf[1] = 0;
+        Buf[2] = TGIF_EXT_TRANSPARENT;
+        Buf[3] = Private->Transparent;
+        InternalWrite(GifFile, Buf, TGIF_EXT_SIZE);
+    }
+
+    /* The preset only fits if it leaves room for codes of our own */
+    Private->PresetCount = 0;
+    Private->PresetMaxLen = 1;
+    if (Private->Preset && Private->Preset[3] < ColorMap->ColorCount) {
+        Private->PresetCount = Private->Preset[4] | (Private->Preset[5] << 8);
+        Private->PresetMaxLen = Private->Preset[6] | (Private->Preset[7] << 8);
+        if (ColorMap->ColorCount + 1 + Private->PresetCount >= LZ_MAX_CODE) {
+            Private->PresetCount = 0;
+            Private->PresetMaxLen = 1;
+        }
+    }
+    if (Private->PresetCount) {
+        Buf[0] = Buf[1] = 0;
+        Buf[2] = TGIF_EXT_PRESET;
+        Buf[3] = Private->Preset[2];
+        InternalWrite(GifFile, Buf, TGIF_EXT_SIZE);
+    }
+
     /* Main header: Compress SRAM limit, dimensions and Color Count */
     SRAMLimit &= ~0xFF;
     if (!SRAMLimit)
@@ -253,8 +452,16 @@ TEGifPutScreenDesc(TGifFileType *GifFile,
     InternalWrite(GifFile, ColorMap->Colors, sizeof(TGifColorType)*ColorMap->ColorCount);
 
     Private->PixelCount = (int)Width * (int)Height;
+    Private->Width = Width;
+    if (Private->Strips)
+        Private->RestartRows = (Height + Private->Strips - 1) / Private->Strips;
+    Private->RestartRow = Private->RestartRows;
+    /* The first pixel is consumed before any restart check. */
+    Private->RestartLeft = (unsigned long)Private->RestartRows * Width - 1;
     /* Reset compress algorithm parameters. */
-    (void)TEGifSetupCompress(GifFile, SRAMLimit);
+    if (TEGifSetupCompress(GifFile, SRAMLimit) == TGIF_ERROR ||
+        TEGifSetupLossy(GifFile, ColorMap) == TGIF_ERROR)
+        return TGIF_ERROR;
 
     /* Mark this file as has screen descriptor, and no pixel written yet: */
     Private->FileState |= FILE_STATE_SCREEN;
@@ -276,9 +483,226 @@ TEGifPutLine(TGifFileType * GifFile, TGifPixelType *Line, int LineLen)
     }
     Private->PixelCount -= LineLen;
 
+    if (Private->Parse == TEGIF_PARSE_FLEXIBLE) {
+        /* It looks ahead, so it only starts once it has all of it. */
+        memcpy(Private->Image + Private->ImageLen, Line, LineLen);
+        Private->ImageLen += LineLen;
+        if (Private->PixelCount)
+            return TGIF_OK;
+        return TEGifCompressFlexible(GifFile, Private->Image, Private->ImageLen);
+    }
     return TEGifCompressLine(GifFile, Line, LineLen);
 }
 
+/******************************************************************************
+ Ask for a restart point every Rows rows. Must come before the screen
+ descriptor.
+******************************************************************************/
+int
+TEGifSetRestartInterval(TGifFileType *GifFile, uint16_t Rows)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (Private->FileState & FILE_STATE_SCREEN) {
+        GifFile->Error = E_TGIF_ERR_HAS_SCRN_DSCR;
+        return TGIF_ERROR;
+    }
+    Private->RestartRows = Rows;
+    Private->Strips = 0;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Ask for restart points that split the image into Strips strips. Must come
+ before the screen descriptor, as the strip height depends on it.
+******************************************************************************/
+int
+TEGifSetStrips(TGifFileType *GifFile, uint16_t Strips)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (Private->FileState & FILE_STATE_SCREEN) {
+        GifFile->Error = E_TGIF_ERR_HAS_SCRN_DSCR;
+        return TGIF_ERROR;
+    }
+    Private->Strips = Strips;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Choose when to clear the dictionary. Must come before the screen descriptor.
+******************************************************************************/
+int
+TEGifSetClearPolicy(TGifFileType *GifFile, int Policy)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (Private->FileState & FILE_STATE_SCREEN) {
+        GifFile->Error = E_TGIF_ERR_HAS_SCRN_DSCR;
+        return TGIF_ERROR;
+    }
+    if (Policy != TEGIF_CLEAR_FULL && Policy != TEGIF_CLEAR_ADAPTIVE)
+        return TGIF_ERROR;
+    Private->ClearPolicy = Policy;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Choose how to parse the image into codes. Must come before the screen
+ descriptor.
+******************************************************************************/
+int
+TEGifSetParse(TGifFileType *GifFile, int Parse)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (Private->FileState & FILE_STATE_SCREEN) {
+        GifFile->Error = E_TGIF_ERR_HAS_SCRN_DSCR;
+        return TGIF_ERROR;
+    }
+    if (Parse != TEGIF_PARSE_GREEDY && Parse != TEGIF_PARSE_FLEXIBLE)
+        return TGIF_ERROR;
+    Private->Parse = Parse;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Allow pixels to come out as another color, no further than MaxError from
+ theirs (0 for lossless). Must come before the screen descriptor.
+******************************************************************************/
+int
+TEGifSetLossy(TGifFileType *GifFile, int MaxError)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (Private->FileState & FILE_STATE_SCREEN) {
+        GifFile->Error = E_TGIF_ERR_HAS_SCRN_DSCR;
+        return TGIF_ERROR;
+    }
+    if (MaxError < 0)
+        return TGIF_ERROR;
+    Private->MaxError = MaxError;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Mark color Index as transparent (-1 for none). Nothing else changes: the
+ pixels of that color are encoded like any other, decoders may just not
+ draw them. Must come before the screen descriptor.
+******************************************************************************/
+int
+TEGifSetTransparent(TGifFileType *GifFile, int Index)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (Private->FileState & FILE_STATE_SCREEN) {
+        GifFile->Error = E_TGIF_ERR_HAS_SCRN_DSCR;
+        return TGIF_ERROR;
+    }
+    if (Index < -1 || Index > 255)
+        return TGIF_ERROR;
+    Private->Transparent = Index;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Start every image's dictionary out with the preset dictionary Preset (see
+ tgif_lib.h, NULL for none) instead of an empty one. Images it has pixels
+ too big for, or too many entries for, go without. Decoders need the same
+ one. Must come before the screen descriptor, Preset stays the caller's.
+******************************************************************************/
+int
+TEGifSetPreset(TGifFileType *GifFile, const TGifByteType *Preset, size_t Len)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+    int i, Count, Prefix;
+
+    if (Private->FileState & FILE_STATE_SCREEN) {
+        GifFile->Error = E_TGIF_ERR_HAS_SCRN_DSCR;
+        return TGIF_ERROR;
+    }
+    if (Preset) {
+        /* Entries may only build on pixels up to the biggest one, and on
+         * entries before them. */
+        if (Len < TGIF_PRESET_HEADER_SIZE || memcmp(Preset, TGIF_PRESET_MAGIC, 2) != 0 ||
+            (Count = Preset[4] | (Preset[5] << 8)) > TGIF_PRESET_MAX_ENTRIES ||
+            Len != TGIF_PRESET_HEADER_SIZE + 3 * (size_t)Count) {
+            GifFile->Error = E_TGIF_ERR_BAD_PRESET;
+            return TGIF_ERROR;
+        }
+        for (i = 0; i < Count; i++) {
+            Prefix = Preset[TGIF_PRESET_HEADER_SIZE + 2 * i] |
+                     (Preset[TGIF_PRESET_HEADER_SIZE + 2 * i + 1] << 8);
+            if ((Prefix > Preset[3] && (Prefix < 256 || Prefix >= 256 + i)) ||
+                Preset[TGIF_PRESET_HEADER_SIZE + 2 * Count + i] > Preset[3]) {
+                GifFile->Error = E_TGIF_ERR_BAD_PRESET;
+                return TGIF_ERROR;
+            }
+        }
+    }
+    Private->Preset = Preset;
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Hand out the restart points collected so far.
+******************************************************************************/
+int
+TEGifGetRestartPoints(TGifFileType *GifFile, const TGifRestartPoint **Points)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    *Points = Private->Restarts;
+    return Private->NumRestarts;
+}
+
+/******************************************************************************
+ Flush the output of the image so far and, when writing to memory, hand it
+ over to the caller.
+******************************************************************************/
+static int
+TEGifFinish(TGifFileType *GifFile)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+    int Flushed = TEGifFlushOut(GifFile);
+
+    if (Private->MemData) {
+        if (Flushed == TGIF_OK) {
+            *Private->MemData = Private->Mem;
+            *Private->MemLen = Private->MemUsed;
+        } else {
+            free(Private->Mem);
+        }
+        Private->Mem = NULL;
+        Private->MemUsed = Private->MemSize = 0;
+    }
+    return Flushed;
+}
+
+/******************************************************************************
+ Finish this image and get ready for the next one, which starts over with
+ TEGifPutScreenDesc (and any dimensions, palette and SRAM limit), to the
+ same output. Memory output hands over each image's buffer here just like
+ TEGifCloseFile does; a file or output function gets the images back to
+ back. Restart settings stay, allocations are kept for reuse.
+******************************************************************************/
+int
+TEGifReset(TGifFileType *GifFile)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (TEGifFinish(GifFile) == TGIF_ERROR) {
+        GifFile->Error = E_TGIF_ERR_WRITE_FAILED;
+        return TGIF_ERROR;
+    }
+    Private->FileState = FILE_STATE_WRITE;
+    Private->DataBytes = 0;
+    Private->NumRestarts = 0;
+    GifFile->MaxCodeUsed = 0;
+    GifFile->Error = 0;
+    return TGIF_OK;
+}
+
 /******************************************************************************
  This routine should be called last, to close the GIF file.
 ******************************************************************************/
@@ -287,6 +711,7 @@ TEGifCloseFile(TGifFileType *GifFile, int *ErrorCode)
 {
     TGifFilePrivateType *Private;
     FILE *File;
+    int Flushed;
 
     if (GifFile == NULL)
         return TGIF_ERROR;
@@ -295,12 +720,14 @@ TEGifCloseFile(TGifFileType *GifFile, int *ErrorCode)
     if (Private == NULL)
 	return TGIF_ERROR;
 
+    Flushed = TEGifFinish(GifFile);
     File = Private->File;
 
     if (Private) {
-        if (Private->HashTable) {
-            free((char *) Private->HashTable);
-        }
+        free(Private->CodeTable);
+        free(Private->Restarts);
+        free(Private->Image);
+        free(Private->Near);
 	free((char *) Private);
     }
 
@@ -311,6 +738,13 @@ TEGifCloseFile(TGifFileType *GifFile, int *ErrorCode)
         return TGIF_ERROR;
     }
 
+    if (Flushed == TGIF_ERROR) {
+	if (ErrorCode != NULL)
+	    *ErrorCode = E_TGIF_ERR_WRITE_FAILED;
+	free(GifFile);
+        return TGIF_ERROR;
+    }
+
     free(GifFile);
     if (ErrorCode != NULL)
 	*ErrorCode = E_TGIF_SUCCEEDED;
@@ -331,21 +765,38 @@ TEGifSetupCompress(TGifFileType *GifFile, uint16_t SRAMLimit)
     InternalWrite(GifFile, &Buf, 1);    /* Write the Code size to file. */
 
     /* Decoder needs 4 bytes per actual dictionary entry, so compute the maximum emitted code. */
-    Private->MaxCodePoint = Private->ColorCount + 1 + (SRAMLimit/4); /* Maximum code actually used */
+    Private->MaxCodePoint = Private->ColorCount + 1 + Private->PresetCount +
+                            (SRAMLimit/4); /* Maximum code actually used */
     if (Private->MaxCodePoint > LZ_MAX_CODE) Private->MaxCodePoint = LZ_MAX_CODE;
+    Private->MaxCodeBits = BitSize(Private->MaxCodePoint - 1);
 
     Private->Buf[0] = 0;    /* Nothing was output yet. */
     Private->ClearCode = Private->ColorCount;
-    Private->RunningCode = Private->ClearCode + 1;
-    Private->RunningBits = BitSize(Private->RunningCode);    /* Number of bits per code. */
-    Private->InitCodeBits = Private->RunningBits;
-    Private->MaxCode1 = 1 << Private->RunningBits;    /* Max. code + 1. */
+    Private->InitCodeBits = BitSize(Private->ClearCode + 1 + Private->PresetCount);
     Private->CrntCode = FIRST_CODE;    /* Signal that this is first one! */
     Private->CrntShiftState = 0;    /* No information in CrntShiftDWord. */
     Private->CrntShiftDWord = 0;
+    Private->PixelsDone = 0;
+    TEGifStartRatio(Private, 0);
+
+    Private->ImageLen = 0;
+    if (Private->Parse == TEGIF_PARSE_FLEXIBLE && Private->ImageSize < Private->PixelCount) {
+        TGifPixelType *Image = realloc(Private->Image, Private->PixelCount);
+        if (!Image) {
+            GifFile->Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
+            return TGIF_ERROR;
+        }
+        Private->Image = Image;
+        Private->ImageSize = Private->PixelCount;
+    }
 
-   /* Clear hash table */
-    _ClearHashTable(Private->HashTable);
+    /* Codes as CrntCode never reach MaxCodePoint, it clears first. */
+    if ((Private->CodeTable = _InitCodeTable(Private->CodeTable, Private->MaxCodePoint,
+                                             Private->ColorCount)) == NULL) {
+        GifFile->Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
+        return TGIF_ERROR;
+    }
+    TEGifClearCodes(Private);
 
     return TGIF_OK;
 }
@@ -362,12 +813,11 @@ TEGifCompressLine(TGifFileType *GifFile,
                  const int LineLen)
 {
     int i = 0, CrntCode, NewCode;
-    unsigned long NewKey;
     TGifPixelType Pixel;
-    TGifHashTableType *HashTable;
+    TGifCodeTableType *CodeTable;
     TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
 
-    HashTable = Private->HashTable;
+    CodeTable = Private->CodeTable;
 
     if (Private->CrntCode == FIRST_CODE)    /* Its first time! */
         CrntCode = Line[i++];
@@ -376,68 +826,435 @@ TEGifCompressLine(TGifFileType *GifFile,
 
     while (i < LineLen) {   /* Decode LineLen items. */
         Pixel = Line[i++];  /* Get next pixel from stream. */
-        /* Form a new unique key to search hash table for the code combines
-         * CrntCode as Prefix string with Pixel as postfix char.
+        if (Private->RestartRows && Private->RestartLeft-- == 0) {
+            /* This pixel starts a restart row: end the current string
+             * here and start over, with this pixel as the first one. */
+            if (TEGifRestart(GifFile, CrntCode) == TGIF_ERROR)
+                return TGIF_ERROR;
+            TEGifStartRatio(Private, Private->PixelsDone + i - 1);
+            CrntCode = Pixel;
+            continue;
+        }
+        /* Look up the code for CrntCode as Prefix string with Pixel as
+         * postfix char.
          */
-        NewKey = (((uint32_t) CrntCode) << 8) + Pixel;
-        if ((NewCode = _ExistsHashTable(HashTable, NewKey)) >= 0) {
+        if ((NewCode = _LookupCodeTable(CodeTable, CrntCode, Pixel)) >= 0) {
             /* This Key is already there, or the string is old one, so
              * simple take new code as our CrntCode:
              */
             CrntCode = NewCode;
+        } else if (Private->Near &&
+                   (NewCode = TEGifLookupNear(Private, CrntCode, Pixel)) >= 0) {
+            /* Not quite, but close enough. */
+            CrntCode = NewCode;
         } else {
-            /* Put it in hash table, output the prefix code, and make our
-             * CrntCode equal to Pixel.
+            /* Put it in the code table, output the prefix code, and make
+             * our CrntCode equal to Pixel.
              */
-            if (TEGifCompressOutput(GifFile, CrntCode) == TGIF_ERROR) {
-                GifFile->Error = E_TGIF_ERR_DISK_IS_FULL;
+            if (TEGifPutCode(GifFile, CrntCode, Pixel, Private->PixelsDone + i - 1)
+                    == TGIF_ERROR)
                 return TGIF_ERROR;
-            }
             CrntCode = Pixel;
-
-            /* If however the HashTable if full, we send a clear first and
-             * Clear the hash table.
-             */
-            if (Private->RunningCode >= Private->MaxCodePoint) {
-                GifFile->MaxCodeUsed = Private->MaxCodePoint;
-                /* Time to do some clearance: */
-                if (TEGifCompressOutput(GifFile, Private->ClearCode)
-                        == TGIF_ERROR) {
-                    GifFile->Error = E_TGIF_ERR_DISK_IS_FULL;
-                    return TGIF_ERROR;
-                }
-                Private->RunningCode = Private->ClearCode + 1;
-                Private->RunningBits = Private->InitCodeBits;
-                Private->MaxCode1 = 1 << Private->RunningBits;
-                _ClearHashTable(HashTable);
-            } else {
-                /* Put this unique key with its relative Code in hash table: */
-                _InsertHashTable(HashTable, NewKey, Private->RunningCode++);
-            }
         }
 
     }
 
     /* Preserve the current state of the compression algorithm: */
     Private->CrntCode = CrntCode;
+    Private->PixelsDone += LineLen;
+
+    if (Private->PixelCount == 0)
+        return TEGifPutLastCode(GifFile, CrntCode);
+
+    return TGIF_OK;
+}
 
-    if (Private->PixelCount == 0) {
-        if (GifFile->MaxCodeUsed < (Private->RunningCode-1)) GifFile->MaxCodeUsed = Private->RunningCode-1;
+/******************************************************************************
+ Lossy encoding, somewhat like gifsicle --lossy: when the string so far can't
+ go on with the next pixel, it can go on with another color no further than
+ MaxError from it instead, if there is one. For that every color gets a
+ list of the ones close enough, nearest first. Distances are between the
+ colors as 8 bit RGB. The transparent color is nowhere near any other.
+******************************************************************************/
+static int
+TEGifColorDistance2(TGifColorType a, TGifColorType b)
+{
+    int r = ((a >> 11) - (b >> 11)) * 255 / 31,
+        g = (((a >> 5) & 0x3F) - ((b >> 5) & 0x3F)) * 255 / 63,
+        bl = ((a & 0x1F) - (b & 0x1F)) * 255 / 31;
+
+    return r * r + g * g + bl * bl;
+}
+
+static int
+TEGifSetupLossy(TGifFileType *GifFile, const TColorMapObject *ColorMap)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+    int Colors = ColorMap->ColorCount, Max2 = Private->MaxError * Private->MaxError,
+        Dist[256], i, j, k, n;
+
+    free(Private->Near);
+    Private->Near = NULL;
+    if (!Private->MaxError)
+        return TGIF_OK;
+    if ((Private->Near = malloc(Colors * Colors)) == NULL) {
+        GifFile->Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
+        return TGIF_ERROR;
+    }
+    for (i = 0; i < Colors; i++) {
+        TGifPixelType *Near = Private->Near + i * Colors;
+
+        /* Insertion sort, there are few */
+        for (n = 0, j = 0; j < Colors; j++) {
+            int d = TEGifColorDistance2(ColorMap->Colors[i], ColorMap->Colors[j]);
+
+            if (j == i || d > Max2 ||
+                i == Private->Transparent || j == Private->Transparent)
+                continue;
+            for (k = n++; k > 0 && Dist[k - 1] > d; k--) {
+                Dist[k] = Dist[k - 1];
+                Near[k] = Near[k - 1];
+            }
+            Dist[k] = d;
+            Near[k] = j;
+        }
+        Private->NearCount[i] = n;
+    }
+    return TGIF_OK;
+}
+
+/* The code for string Code followed by a color near Pixel, -1 if none. */
+static int
+TEGifLookupNear(const TGifFilePrivateType *Private, int Code, TGifPixelType Pixel)
+{
+    const TGifPixelType *Near = Private->Near + Pixel * Private->ColorCount;
+    int i, NewCode;
+
+    if (Pixel >= Private->ColorCount)
+        return -1;
+    for (i = 0; i < Private->NearCount[Pixel]; i++) {
+        if ((NewCode = _LookupCodeTable(Private->CodeTable, Code, Near[i])) >= 0)
+            return NewCode;
+    }
+    return -1;
+}
 
-        /* We are done - output last Code and flush output buffers: */
-        if (TEGifCompressOutput(GifFile, CrntCode) == TGIF_ERROR) {
-            GifFile->Error = E_TGIF_ERR_DISK_IS_FULL;
+/******************************************************************************
+ The codes of the strings in the code table that Pixels (up to Len of them)
+ start with, shortest first. Returns how many there are.
+******************************************************************************/
+static int
+TEGifMatch(const TGifFilePrivateType *Private, const TGifPixelType *Pixels,
+           unsigned long Len, int *Codes)
+{
+    int Code = Pixels[0], NewCode;
+    unsigned long i;
+
+    if (Codes)
+        Codes[0] = Code;
+    for (i = 1; i < Len; i++) {
+        if ((NewCode = _LookupCodeTable(Private->CodeTable, Code, Pixels[i])) < 0 &&
+            (!Private->Near || (NewCode = TEGifLookupNear(Private, Code, Pixels[i])) < 0))
+            break;
+        Code = NewCode;
+        if (Codes)
+            Codes[i] = Code;
+    }
+    return i;
+}
+
+/******************************************************************************
+ Flexible parse trial: output Code, the first Length of Pixels (up to Len),
+ then carry on greedily, adding to the code table as we go. Returns how many
+ codes it takes to get past TEGIF_FLEX_WINDOW pixels, and where that got to
+ in *Reach. The code table is left as it was.
+******************************************************************************/
+static int
+TEGifFlexTrial(TGifFilePrivateType *Private, const TGifPixelType *Pixels,
+               unsigned long Len, int Code, int Length, unsigned long *Reach)
+{
+    TGifCodeTableType *CodeTable = Private->CodeTable;
+    int AddedCode[TEGIF_FLEX_WINDOW];
+    TGifPixelType AddedPixel[TEGIF_FLEX_WINDOW];
+    int Added = 0, RunningCode = Private->RunningCode, Codes = 1, NewCode;
+    unsigned long i = Length;
+
+    while (i < Len && i < TEGIF_FLEX_WINDOW) {
+        if (RunningCode < Private->MaxCodePoint) {
+            if (_LookupCodeTable(CodeTable, Code, Pixels[i]) < 0) {
+                _InsertCodeTable(CodeTable, Code, Pixels[i], RunningCode);
+                AddedCode[Added] = Code;
+                AddedPixel[Added++] = Pixels[i];
+            }
+            RunningCode++;
+        }
+        Code = Pixels[i++];
+        while (i < Len &&
+               ((NewCode = _LookupCodeTable(CodeTable, Code, Pixels[i])) >= 0 ||
+                (Private->Near && (NewCode = TEGifLookupNear(Private, Code, Pixels[i])) >= 0))) {
+            Code = NewCode;
+            i++;
+        }
+        Codes++;
+    }
+    while (Added--)
+        _RemoveCodeTable(CodeTable, AddedCode[Added], AddedPixel[Added]);
+    *Reach = i;
+    return Codes;
+}
+
+/******************************************************************************
+ The flexible parse: instead of always the longest string in the code table,
+ take whichever of it and its prefixes does best. Codes still add their
+ string plus the next pixel to the code table, as the decoder expects, so
+ a shorter string adds one that is there already and wastes its code.
+ While the code table is filling up, that is only worth it if it saves a
+ code over the next TEGIF_FLEX_WINDOW pixels, which we try out for the
+ longest TEGIF_FLEX_TRIES strings. The trials assume the strings after are
+ the longest ones, so the one after a shorter string is: otherwise some
+ repeating patterns get stuck taking a shorter string every time, with the
+ code table never growing. Once it is full (and kept, see
+ TEGIF_CLEAR_ADAPTIVE) nothing gets added, so we take the string after
+ which the next one reaches furthest. Needs the whole image, Len pixels.
+******************************************************************************/
+static int
+TEGifCompressFlexible(TGifFileType *GifFile, const TGifPixelType *Image,
+                      unsigned long Len)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+    unsigned long Pos = 0, End, Interval, NextRestart, Reach, r;
+    int Codes[LZ_MAX_CODE + 1], Match, Best, BestCodes, c, l, RunningCode,
+        Shortened = 0,  /* The last string was not the longest. */
+        Longest = Private->PresetMaxLen;    /* No string in the code table is longer. */
+
+    Interval = (unsigned long)Private->RestartRows * Private->Width;
+    NextRestart = Interval ? Interval : Len;
+    while (Pos < Len) {
+        End = NextRestart < Len ? NextRestart : Len;
+        Match = TEGifMatch(Private, Image + Pos, End - Pos, Codes);
+
+        Best = Match;
+        if (Match > 1 && Private->RunningCode < Private->MaxCodePoint) {
+            if (!Shortened) {
+                BestCodes = TEGifFlexTrial(Private, Image + Pos, End - Pos,
+                                           Codes[Match - 1], Match, &Reach);
+                for (l = Match - 1; l > 0 && l > Match - TEGIF_FLEX_TRIES; l--) {
+                    c = TEGifFlexTrial(Private, Image + Pos, End - Pos, Codes[l - 1], l, &r);
+                    if (c < BestCodes) {
+                        BestCodes = c;
+                        Best = l;
+                    }
+                }
+            }
+        } else if (Match > 1) {
+            /* Nothing after l reaches past l + Longest, so stop once
+             * that can't do better. */
+            Reach = 0;
+            for (l = Match; l > 0 && (unsigned long)(l + Longest) > Reach; l--) {
+                r = l;
+                if (Pos + l < End)
+                    r += TEGifMatch(Private, Image + Pos + l, End - Pos - l, NULL);
+                if (r > Reach) {
+                    Reach = r;
+                    Best = l;
+                }
+            }
+        }
+        Shortened = Best < Match;
+        Pos += Best;
+
+        if (Pos == Len)
+            return TEGifPutLastCode(GifFile, Codes[Best - 1]);
+        if (Pos == NextRestart) {
+            if (TEGifRestart(GifFile, Codes[Best - 1]) == TGIF_ERROR)
+                return TGIF_ERROR;
+            TEGifStartRatio(Private, Pos);
+            NextRestart += Interval;
+            Longest = Private->PresetMaxLen;
+            continue;
+        }
+        RunningCode = Private->RunningCode;
+        if (TEGifPutCode(GifFile, Codes[Best - 1], Image[Pos], Pos) == TGIF_ERROR)
             return TGIF_ERROR;
+        if (Private->RunningCode < RunningCode)
+            Longest = Private->PresetMaxLen;    /* Cleared. */
+        else if (Best + 1 > Longest)
+            Longest = Best + 1;
+    }
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Output Code, the string before pixel number Pos, and add that string plus
+ the Pixel there to the code table (or clear it, if full). For both parses.
+******************************************************************************/
+static int
+TEGifPutCode(TGifFileType *GifFile, int Code, TGifPixelType Pixel, unsigned long Pos)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+    TGifCodeTableType *CodeTable = Private->CodeTable;
+
+    if (TEGifCompressOutput(GifFile, Code) == TGIF_ERROR) {
+        GifFile->Error = E_TGIF_ERR_DISK_IS_FULL;
+        return TGIF_ERROR;
+    }
+
+    /* If however the code table is full, we send a clear first
+     * and clear the code table - or, adaptively, keep using it
+     * as it is until that stops paying off.
+     */
+    if (Private->RunningCode >= Private->MaxCodePoint) {
+        GifFile->MaxCodeUsed = Private->MaxCodePoint;
+        if (Private->ClearPolicy == TEGIF_CLEAR_FULL ||
+            TEGifRatioDropped(Private, Pos)) {
+            /* Time to do some clearance: */
+            if (TEGifCompressOutput(GifFile, Private->ClearCode)
+                    == TGIF_ERROR) {
+                GifFile->Error = E_TGIF_ERR_DISK_IS_FULL;
+                return TGIF_ERROR;
+            }
+            TEGifClearCodes(Private);
+            TEGifStartRatio(Private, Pos);
         }
-        if (TEGifCompressOutput(GifFile, FLUSH_OUTPUT) == TGIF_ERROR) {
-            GifFile->Error = E_TGIF_ERR_DISK_IS_FULL;
+    } else {
+        /* Put this string with its relative Code in code table. It can
+         * be there already: the decoder gives it a code all the same, we
+         * keep using the old one.
+         */
+        if (_LookupCodeTable(CodeTable, Code, Pixel) < 0)
+            _InsertCodeTable(CodeTable, Code, Pixel, Private->RunningCode);
+        Private->RunningCode++;
+    }
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Output the last Code of the image and flush the output buffers.
+******************************************************************************/
+static int
+TEGifPutLastCode(TGifFileType *GifFile, int Code)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (GifFile->MaxCodeUsed < (Private->RunningCode-1)) GifFile->MaxCodeUsed = Private->RunningCode-1;
+
+    /* We are done - output last Code and flush output buffers: */
+    if (TEGifCompressOutput(GifFile, Code) == TGIF_ERROR) {
+        GifFile->Error = E_TGIF_ERR_DISK_IS_FULL;
+        return TGIF_ERROR;
+    }
+    if (TEGifCompressOutput(GifFile, FLUSH_OUTPUT) == TGIF_ERROR) {
+        GifFile->Error = E_TGIF_ERR_DISK_IS_FULL;
+        return TGIF_ERROR;
+    }
+    return TGIF_OK;
+}
+
+/******************************************************************************
+ Output CrntCode and a clear code, and record where the code after them
+ starts as the restart point for the next restart row.
+******************************************************************************/
+static int
+TEGifRestart(TGifFileType *GifFile, int CrntCode)
+{
+    TGifFilePrivateType *Private = (TGifFilePrivateType *) GifFile->Private;
+
+    if (GifFile->MaxCodeUsed < (Private->RunningCode-1)) GifFile->MaxCodeUsed = Private->RunningCode-1;
+
+    if (TEGifCompressOutput(GifFile, CrntCode) == TGIF_ERROR ||
+        TEGifCompressOutput(GifFile, Private->ClearCode) == TGIF_ERROR) {
+        GifFile->Error = E_TGIF_ERR_DISK_IS_FULL;
+        return TGIF_ERROR;
+    }
+    TEGifClearCodes(Private);
+
+    /* The bits of the next code still in CrntShiftDWord go into the byte
+     * after the DataBytes already output and the code count byte. */
+    if ((Private->NumRestarts % 16) == 0) {
+        TGifRestartPoint *Restarts = realloc(Private->Restarts,
+            (Private->NumRestarts + 16) * sizeof(TGifRestartPoint));
+        if (!Restarts) {
+            GifFile->Error = E_TGIF_ERR_NOT_ENOUGH_MEM;
             return TGIF_ERROR;
         }
+        Private->Restarts = Restarts;
     }
+    TGifRestartPoint *Point = &Private->Restarts[Private->NumRestarts++];
+    Point->Offset = 1 + Private->DataBytes;
+    Point->RowBit = TGIF_RP_ROWBIT(Private->RestartRow, Private->CrntShiftState);
 
+    Private->RestartRow += Private->RestartRows;
+    Private->RestartLeft = (unsigned long)Private->RestartRows * Private->Width - 1;
     return TGIF_OK;
 }
 
+/******************************************************************************
+ Start over with an empty code table, or the preset entries as codes
+ ClearCode + 1 on.
+******************************************************************************/
+static void
+TEGifClearCodes(TGifFilePrivateType *Private)
+{
+    const TGifByteType *Prefix, *Suffix;
+    int i, Code;
+
+    Private->RunningCode = Private->ClearCode + 1;
+    Private->RunningBits = Private->InitCodeBits;
+    Private->MaxCode1 = 1 << Private->RunningBits;
+    _ClearCodeTable(Private->CodeTable);
+    if (!Private->PresetCount)
+        return;
+
+    Prefix = Private->Preset + TGIF_PRESET_HEADER_SIZE;
+    Suffix = Prefix + 2 * Private->PresetCount;
+    for (i = 0; i < Private->PresetCount; i++) {
+        Code = Prefix[2 * i] | (Prefix[2 * i + 1] << 8);
+        if (Code >= 256)
+            Code += Private->ClearCode + 1 - 256;
+        _InsertCodeTable(Private->CodeTable, Code, Suffix[i], Private->RunningCode++);
+    }
+}
+
+/******************************************************************************
+ Adaptive clears, somewhat like compress(1) does them: filling the dictionary
+ up took FillBits for FillPixels, and a new one would cost about as much.
+ Once full it is kept, but checked every 1/8th of FillPixels, and cleared
+ when that last stretch took more than 95% of the bits per pixel filling it
+ did (a new dictionary does better than that once it is full itself).
+ Pixel is the number of pixels before the current string.
+******************************************************************************/
+static void
+TEGifStartRatio(TGifFilePrivateType *Private, unsigned long Pixel)
+{
+    Private->ClearPixel = Pixel;
+    Private->ClearBits = Private->DataBytes * 8 + Private->CrntShiftState;
+    Private->FillPixels = 0;
+}
+
+static int
+TEGifRatioDropped(TGifFilePrivateType *Private, unsigned long Pixel)
+{
+    unsigned long Bits = Private->DataBytes * 8 + Private->CrntShiftState;
+
+    if (!Private->FillPixels) {
+        /* Just filled up. */
+        Private->FillPixels = Pixel - Private->ClearPixel;
+        Private->FillBits = Bits - Private->ClearBits;
+        Private->CheckGap = Private->FillPixels / 8;
+        if (Private->CheckGap < 16)
+            Private->CheckGap = 16;
+    } else if (Pixel < Private->CheckAt) {
+        return 0;
+    } else if ((uint64_t)(Bits - Private->WinBits) * Private->FillPixels * 20 >
+               (uint64_t)Private->FillBits * (Pixel - Private->WinPixel) * 19) {
+        return 1;
+    }
+    Private->WinPixel = Pixel;
+    Private->WinBits = Bits;
+    Private->CheckAt = Pixel + Private->CheckGap;
+    return 0;
+}
+
 /******************************************************************************
  The LZ compression output routine:
  This routine is responsible for the compression of the bit stream into
@@ -480,7 +1297,9 @@ TEGifCompressOutput(TGifFileType *GifFile,
 
     /* If code cannt fit into RunningBits bits, must raise its size. Note */
     /* however that codes above 4095 are used for special signaling.      */
-    if (Private->RunningCode >= Private->MaxCode1 && Code <= LZ_MAX_CODE) {
+    /* The decoder stops growing at MaxCodeBits, so must we.               */
+    if (Private->RunningCode >= Private->MaxCode1 && Code <= LZ_MAX_CODE &&
+        Private->RunningBits < Private->MaxCodeBits) {
        Private->MaxCode1 = 1 << ++Private->RunningBits;
     }
 
@@ -514,6 +1333,7 @@ TEGifBufferedOutput(TGifFileType *GifFile,
             Buf[0] = 0;
         }
         Buf[++Buf[0]] = c;
+        ((TGifFilePrivateType *) GifFile->Private)->DataBytes++;
     }
 
     return TGIF_OK;
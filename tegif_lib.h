@@ -9,9 +9,13 @@ typedef struct TColorMapObject {
 typedef struct TGifFileType {
     int Error;			     /* Last error condition reported */
     int MaxCodeUsed;
+    void *UserData;                  /* For the output function, if any */
     void *Private;                   /* Don't mess with this! */
 } TGifFileType;
 
+/* Gets the encoded bytes, returns how many it took (short means failure) */
+typedef int (*TEGifOutputFunc) (TGifFileType *GifFile, const TGifByteType *Buf, int Len);
+
 
 /******************************************************************************
  GIF encoding routines
@@ -19,6 +23,11 @@ typedef struct TGifFileType {
 
 /* Main entry points, you basically just run through them in this order. */
 TGifFileType *TEGifOpenFileName(const char *GifFileName, int *Error);
+/* Or into memory: on a successful TEGifCloseFile, *Data is a malloc()ed
+ * buffer holding all *Len bytes of the image, for the caller to free. */
+TGifFileType *TEGifOpenMemory(TGifByteType **Data, size_t *Len, int *Error);
+/* Or through OutputFunc, with UserData in the TGifFileType for it. */
+TGifFileType *TEGifOpenCallback(void *UserData, TEGifOutputFunc OutputFunc, int *Error);
 int TEGifPutScreenDesc(TGifFileType *GifFile,
                   const uint16_t Width,
                   const uint16_t Height,
@@ -27,7 +36,44 @@ int TEGifPutScreenDesc(TGifFileType *GifFile,
 int TEGifPutLine(TGifFileType *GifFile, TGifPixelType *GifLine,
                 int GifLineLen);
 int TEGifCloseFile(TGifFileType *GifFile, int *ErrorCode);
+/* Or, to encode another image with the same context and output: finish
+ * this one, then start the next with TEGifPutScreenDesc. */
+int TEGifReset(TGifFileType *GifFile);
+
+/* Optional, before TEGifPutScreenDesc: clear the dictionary every Rows rows
+ * so decoding can start there, and note where in the restart points. */
+int TEGifSetRestartInterval(TGifFileType *GifFile, uint16_t Rows);
+/* Or: split the image into Strips strips of equal height, each starting at
+ * a restart point, so they can be decoded independently. */
+int TEGifSetStrips(TGifFileType *GifFile, uint16_t Strips);
+/* Optional, before TEGifPutScreenDesc: when to clear the dictionary, one
+ * of TEGIF_CLEAR_*. Decoders don't care, any of them decode the same. */
+int TEGifSetClearPolicy(TGifFileType *GifFile, int Policy);
+/* Optional, before TEGifPutScreenDesc: how to split the image into codes,
+ * one of TEGIF_PARSE_*. Again, any of them decode the same. */
+int TEGifSetParse(TGifFileType *GifFile, int Parse);
+/* Optional, before TEGifPutScreenDesc: lossy encoding, where a pixel may
+ * come out as another color up to MaxError away (as 8 bit RGB, Euclidean),
+ * if that compresses better. 0, the default, for lossless. */
+int TEGifSetLossy(TGifFileType *GifFile, int MaxError);
+/* Optional, before TEGifPutScreenDesc: which color is transparent, -1
+ * (the default) for none. */
+int TEGifSetTransparent(TGifFileType *GifFile, int Index);
+/* Optional, before TEGifPutScreenDesc: start the dictionary out with the
+ * preset dictionary Preset (see tgif_lib.h) of Len bytes, NULL (the
+ * default) for none. Images it does not fit go without. It has to stay
+ * around. */
+int TEGifSetPreset(TGifFileType *GifFile, const TGifByteType *Preset, size_t Len);
+/* The restart points so far, valid until TEGifReset or TEGifCloseFile.
+ * Returns count. */
+int TEGifGetRestartPoints(TGifFileType *GifFile, const TGifRestartPoint **Points);
+
+#define TEGIF_CLEAR_FULL          0 /* As soon as the dictionary is full (default) */
+#define TEGIF_CLEAR_ADAPTIVE      1 /* Keep a full one while it still compresses well */
 
+#define TEGIF_PARSE_GREEDY        0 /* Longest string in the dictionary (default) */
+#define TEGIF_PARSE_FLEXIBLE      1 /* Or a shorter one, if that gets further with the next
+                                     * (buffers the whole image, many times slower) */
 
 #define E_TGIF_SUCCEEDED          0
 #define E_TGIF_ERR_OPEN_FAILED    1    /* And TEGif possible errors. */
@@ -40,5 +86,6 @@ int TEGifCloseFile(TGifFileType *GifFile, int *ErrorCode);
 #define E_TGIF_ERR_DISK_IS_FULL   8
 #define E_TGIF_ERR_CLOSE_FAILED   9
 #define E_TGIF_ERR_NOT_WRITEABLE  10
+#define E_TGIF_ERR_BAD_PRESET     11
 
 
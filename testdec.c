@@ -12,8 +12,11 @@
 
 
 static TGifInfo Info;
+static const uint8_t *preset;   /* -P: the preset dictionary, if any */
+static int preset_len;
 
 static int output_calls = 0;
+static int output_width;
 
 static char output_xt[256];
 
@@ -54,7 +57,19 @@ void MakeXT(void) {
 void Output(uint8_t c) {
 	printf("%c", output_xt[c]);
 	output_calls++;
-	if ((output_calls % Info.Width)==0) printf("\n");
+	if ((output_calls % output_width)==0) printf("\n");
+}
+
+
+/* Sprites: the opaque runs go onto a canvas, the rest is left '.' */
+static char *canvas;
+static int opaque_pixels = 0;
+
+void OutputOpaque(uint16_t x, uint16_t y, const uint8_t *p, uint16_t len) {
+	output_calls++;
+	opaque_pixels += len;
+	while (len--)
+		canvas[y * output_width + x++] = output_xt[*p++];
 }
 
 
@@ -64,9 +79,101 @@ static void PrintError(int error) {
 }
 
 
+/* A tiny animation: every frame decoded onto the last, and printed whole */
+static int TestAnim(const void *data, int len) {
+	TGifAnimInfo Anim;
+	if (TDGifGetAnimInfo(data, &Anim, 1023, 1023, len) == TGIF_ERROR) {
+		PrintError(Anim.Error);
+		return 5;
+	}
+	printf("%dx%d animation with %d colors and %d frames, requires %d bytes of SRAM to decode (len=%d)\n",
+		Anim.Width, Anim.Height, Anim.Frame.ColorCount, Anim.FrameCount, Anim.Frame.SRAMLimit, len);
+
+	Info.ColorCount = Anim.Frame.ColorCount;
+	Info.Colors = Anim.Frame.Colors;
+	MakeXT();
+	uint8_t *fb = malloc(Anim.Width * Anim.Height);
+	for (int n = 0; n < Anim.FrameCount; n++) {
+		if (TDGifDecompressFrame(&Anim, fb, Anim.Width, TDGIF_FMT_INDEX8) == TGIF_ERROR) {
+			PrintError(Anim.Error);
+			return 6;
+		}
+		printf("frame %d: %dx%d at %d,%d, %d0 ms\n", Anim.FrameNum, Anim.Frame.Width,
+			Anim.Frame.Height, Anim.X, Anim.Y, Anim.Delay);
+		for (int y = 0; y < Anim.Height; y++) {
+			for (int x = 0; x < Anim.Width; x++)
+				printf("%c", output_xt[fb[y * Anim.Width + x]]);
+			printf("\n");
+		}
+	}
+	free(fb);
+	printf("Decode success with %d frames\n", Anim.FrameCount);
+	return 0;
+}
+
+/* A tiny archive: all of its images, or just the one with id Id (if >= 0) */
+static int TestArchive(const void *data, int len, int id) {
+	TGifArchive Archive;
+	if (TDGifOpenArchive(data, &Archive, len) == TGIF_ERROR) {
+		PrintError(Archive.Error);
+		return 5;
+	}
+	printf("Archive of %d images with %d palettes (len=%d)\n", Archive.Count, Archive.PaletteCount, len);
+
+	int first = 0, last = Archive.Count - 1;
+	if (id >= 0) {
+		first = last = TDGifArchiveFind(&Archive, id);
+		if (first < 0) {
+			PrintError(D_TGIF_ERR_NOT_FOUND);
+			return 5;
+		}
+	}
+	for (int n = first; n <= last; n++) {
+		if (TDGifArchiveGetInfo(&Archive, n, &Info, 1023, 1023) == TGIF_ERROR ||
+		    TDGifSetPreset(&Info, preset, preset_len) == TGIF_ERROR) {
+			PrintError(Info.Error);
+			return 5;
+		}
+		printf("image %d: %dx%d with %d colors, requires %d bytes of SRAM to decode\n",
+			n, Info.Width, Info.Height, Info.ColorCount, Info.SRAMLimit);
+		MakeXT();
+		output_width = Info.Width;
+		output_calls = 0;
+		if (TDGifDecompress(&Info, Output) == TGIF_ERROR) {
+			PrintError(Info.Error);
+			return 6;
+		}
+	}
+	printf("Decode success with %d images\n", last - first + 1);
+	return 0;
+}
+
 int main(int argc, char** argv) {
-	if (argc != 2) {
-		fprintf(stderr, "%s <tgif.bin>", argv[0]);
+	if (argc >= 3 && !strcmp(argv[1], "-P")) {
+		/* The preset dictionary images may need */
+		static uint8_t buf[TGIF_PRESET_HEADER_SIZE + 3 * TGIF_PRESET_MAX_ENTRIES];
+		FILE *f = fopen(argv[2], "rb");
+		if (!f) {
+			fprintf(stderr, "open '%s' failed\n", argv[2]);
+			return 2;
+		}
+		preset_len = fread(buf, 1, sizeof(buf), f);
+		preset = buf;
+		fclose(f);
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	int scale = 0;
+	if (argc >= 3 && !strcmp(argv[1], "-z")) {
+		/* A preview, scaled down by this much */
+		scale = atoi(argv[2]);
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	if ((argc != 2) && (argc != 3) && (argc != 7)) {
+		fprintf(stderr, "%s [-P <preset.bin>] [-z <scale>] <tgif.bin> [<restart points> <x> <y> <w> <h> | <archive id>]", argv[0]);
 		return 1;
 	}
 	int fd = open(argv[1], O_RDONLY);
@@ -85,17 +192,96 @@ int main(int argc, char** argv) {
 		return 4;
 	}
 
-	if (TDGifGetInfo(data, &Info, 1023, 1023, len) == TGIF_ERROR) {
+	if (len >= 2 && !memcmp(data, TGIF_ANIM_MAGIC, 2))
+		return TestAnim(data, len);
+	if (len >= 2 && !memcmp(data, TGIF_ARCHIVE_MAGIC, 2))
+		return TestArchive(data, len, argc == 3 ? atoi(argv[2]) : -1);
+
+	if (TDGifGetInfo(data, &Info, 1023, 1023, len) == TGIF_ERROR ||
+	    TDGifSetPreset(&Info, preset, preset_len) == TGIF_ERROR) {
 		PrintError(Info.Error);
 		return 5;
 	}
 
 	printf("%dx%d image with %d colors, requires %d bytes of SRAM to decode (len=%d)\n",
 		Info.Width, Info.Height, Info.ColorCount, Info.SRAMLimit, len);
+	if (Info.PresetId >= 0)
+		printf("Starts out with preset dictionary %d\n", Info.PresetId);
 
 	MakeXT();
+	output_width = Info.Width;
 
-	if (TDGifDecompress(&Info, Output) == TGIF_ERROR) {
+	if (scale) {
+		/* Nearest pixels only, skipping what the restart points allow */
+		static TGifRestartPoint Points[1024];
+		int NumPoints = 0;
+		FILE *f = argc == 3 ? fopen(argv[2], "rb") : NULL;
+		if (f) {
+			NumPoints = fread(Points, sizeof(TGifRestartPoint), 1024, f);
+			fclose(f);
+		}
+		int w = TDGIF_SCALED(Info.Width, scale), h = TDGIF_SCALED(Info.Height, scale);
+		uint8_t *fb = malloc(w * h);
+		if (TDGifDecompressScaled(&Info, Points, NumPoints, scale, TDGIF_SCALE_NEAREST,
+				fb, w, TDGIF_FMT_INDEX8) == TGIF_ERROR) {
+			PrintError(Info.Error);
+			return 6;
+		}
+		for (int y = 0; y < h; y++) {
+			for (int x = 0; x < w; x++)
+				printf("%c", output_xt[fb[y * w + x]]);
+			printf("\n");
+		}
+		free(fb);
+		printf("Decode success at 1/%d: %dx%d, %d restart points\n", scale, w, h, NumPoints);
+		return 0;
+	}
+
+	if (argc == 7) {
+		/* Just a viewport, decoded from the nearest restart point */
+		const TGifRestartPoint *Points = NULL;
+		int NumPoints = 0;
+		FILE *f = fopen(argv[2], "rb");
+		if (f) {
+			static TGifRestartPoint Buf[1024];
+			NumPoints = fread(Buf, sizeof(TGifRestartPoint), 1024, f);
+			Points = Buf;
+			fclose(f);
+		}
+		printf("%d restart points\n", NumPoints);
+
+		TDGifState State;
+		output_width = atoi(argv[5]);
+		if (TDGifBegin(&State, &Info) == TGIF_ERROR) {
+			PrintError(Info.Error);
+			return 6;
+		}
+		TDGifSetPixelOutput(&State, Output);
+		if ((TDGifSetRect(&State, Points, NumPoints, atoi(argv[3]), atoi(argv[4]),
+				output_width, atoi(argv[6])) == TGIF_ERROR) ||
+		    (TDGifStep(&State, Info.Width * Info.Height) == TGIF_ERROR)) {
+			PrintError(Info.Error);
+			TDGifEnd(&State);
+			return 6;
+		}
+		TDGifEnd(&State);
+		printf("Decode success with %d output calls\n", output_calls);
+		return 0;
+	}
+
+	if (Info.Transparent >= 0) {
+		printf("Color %d is transparent\n", Info.Transparent);
+		canvas = malloc(Info.Width * Info.Height);
+		memset(canvas, '.', Info.Width * Info.Height);
+		if (TDGifDecompressOpaque(&Info, OutputOpaque) == TGIF_ERROR) {
+			PrintError(Info.Error);
+			return 6;
+		}
+		for (int y = 0; y < Info.Height; y++)
+			printf("%.*s\n", Info.Width, canvas + y * Info.Width);
+		printf("%d opaque pixels of %d\n", opaque_pixels, Info.Width * Info.Height);
+		free(canvas);
+	} else if (TDGifDecompress(&Info, Output) == TGIF_ERROR) {
 		PrintError(Info.Error);
 		return 6;
 	}
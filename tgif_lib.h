@@ -15,3 +15,65 @@ typedef unsigned char TGifPixelType;
 typedef unsigned char TGifByteType;
 typedef int TGifWord;
 typedef uint16_t TGifColorType;
+
+/* A restart point: the first code after a clear that starts row Row.
+ * Offset is counted from the code count byte in front of the LZW data, and
+ * the code starts at bit Bit of that byte. Row and Bit share RowBit. */
+typedef struct TGifRestartPoint {
+    uint16_t Offset;
+    uint16_t RowBit;
+} TGifRestartPoint;
+
+#define TGIF_RP_ROW(RowBit)       ((RowBit) & 0x3FF)
+#define TGIF_RP_BIT(RowBit)       ((RowBit) >> 12)
+#define TGIF_RP_ROWBIT(Row, Bit)  ((Row) | ((Bit) << 12))
+
+/* Tiny animation: "TA", the same 4 bytes as an image header (for the size
+ * of the whole animation, and the SRAM limit and color count of all of its
+ * frames), the number of frames and the shared palette. Then per frame: how
+ * long to show it in 1/100 s, X, Y, Width and Height of the rectangle it
+ * changes and the length of its data, then that data: a Width x Height
+ * image without the header and palette. All of the frame numbers are 16 bit
+ * little endian. The first frame covers the whole animation. */
+#define TGIF_ANIM_MAGIC           "TA"
+#define TGIF_ANIM_HEADER_SIZE     8     /* Up to the palette */
+#define TGIF_FRAME_HEADER_SIZE    12
+
+/* An image may start with extensions: 4 bytes each, 0, 0 (never a valid
+ * header, its width would be 0), the type and a byte for it. Decoders skip
+ * types they do not know. */
+#define TGIF_EXT_SIZE             4
+#define TGIF_EXT_TRANSPARENT      1     /* The transparent color index */
+#define TGIF_EXT_PRESET           2     /* The Id of the preset dictionary it needs */
+
+/* Tiny archive: many images in one file, for icons and sprites, without a
+ * header and palette each. "TR", the number of images and of palettes, two
+ * 0 bytes, then the directory: per image, in order of Id, its 16 bit Id,
+ * its 4 header bytes, ExtPalette (the number of extension blocks it starts
+ * with and the index of its palette, see below) and the 32 bit offset of
+ * its data. Then the 32 bit offset of every palette. Each one has at least
+ * as many colors as the images using it say. The data of an image is its
+ * extensions, code count byte and LZW data, up to where the next one's
+ * starts (or the end of the archive). Offsets are from the start of the
+ * archive, palettes start at multiples of 4 (the data is read a byte at a
+ * time), and all numbers are little endian. */
+#define TGIF_ARCHIVE_MAGIC        "TR"
+#define TGIF_ARCHIVE_HEADER_SIZE  8
+#define TGIF_ARCHIVE_ENTRY_SIZE   12
+#define TGIF_ARCHIVE_ALIGN        4
+
+#define TGIF_AR_PALETTE(ExtPalette)  ((ExtPalette) & 0xFFF)
+#define TGIF_AR_EXTS(ExtPalette)     ((ExtPalette) >> 12)
+#define TGIF_AR_EXTPALETTE(Exts, Palette)  ((Palette) | ((Exts) << 12))
+
+/* Preset dictionary, shared by a family of small images (glyphs, icons)
+ * that were encoded with it, so theirs does not start out empty. "TP", its
+ * Id, the biggest pixel value in it, the number of entries and the length
+ * of its longest string. Then per entry its 16 bit prefix, a pixel value
+ * (below 256) or 256 plus the index of an earlier entry, and after all of
+ * those, per entry the pixel that follows the prefix. In an image entry n
+ * is code ClearCode + 1 + n, and new entries come after them. All 16 bit
+ * numbers are little endian. */
+#define TGIF_PRESET_MAGIC         "TP"
+#define TGIF_PRESET_HEADER_SIZE   8
+#define TGIF_PRESET_MAX_ENTRIES   512